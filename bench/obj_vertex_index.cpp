@@ -0,0 +1,113 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Compares the vertex deduplication of the OBJ writers before and after VertexIndex,
+// ie. std::set + std::map with a map lookup per face corner, against one VertexIndex
+// probe per corner. The input is a TriangleCollection like grid of about a million
+// triangles in which every vertex is shared by up to 6 triangles.
+//
+//   bench_obj_vertex_index [n_triangles]
+#include "../vertex_index.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace geoflow::nodes::basic3d;
+
+typedef std::array<float,3> arr3f;
+typedef std::array<arr3f,3> Triangle;
+
+static std::vector<Triangle> make_triangles(size_t n_triangles) {
+  size_t n = 1;
+  while (2 * n * n < n_triangles) ++n;
+  std::vector<Triangle> tc;
+  tc.reserve(2 * n * n);
+  auto vertex = [](size_t i, size_t j) {
+    // georeferenced coordinates after the data offset, with some height variation
+    return arr3f{float(i) * 0.5f - 1000.f, float(j) * 0.5f + 250.f, float((i * 7 + j * 13) % 17) * 0.25f};
+  };
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < n; ++j) {
+      tc.push_back({vertex(i, j), vertex(i + 1, j), vertex(i + 1, j + 1)});
+      tc.push_back({vertex(i, j), vertex(i + 1, j + 1), vertex(i, j + 1)});
+    }
+  }
+  return tc;
+}
+
+// the baseline add_vertices() and write_triangles() lookups
+static size_t index_map(const std::vector<Triangle>& tc, std::vector<arr3f>& vertex_vec, std::vector<size_t>& face_indices) {
+  std::map<arr3f, size_t> vertex_map;
+  std::set<arr3f> vertex_set;
+  size_t v_cntr = 0;
+  for (auto& triangle : tc) {
+    for (auto& vertex : triangle) {
+      auto [it, did_insert] = vertex_set.insert(vertex);
+      if (did_insert) {
+        vertex_map[vertex] = ++v_cntr;
+        vertex_vec.push_back(vertex);
+      }
+    }
+  }
+  for (auto& triangle : tc) {
+    for (auto& vertex : triangle) face_indices.push_back(vertex_map[vertex]);
+  }
+  return vertex_vec.size();
+}
+
+// the current add_vertices()
+static size_t index_hash(const std::vector<Triangle>& tc, std::vector<arr3f>& vertex_vec, std::vector<size_t>& face_indices) {
+  VertexIndex<arr3f> vertex_index(tc.size());
+  face_indices.reserve(3 * tc.size());
+  for (auto& triangle : tc) {
+    for (auto& vertex : triangle) {
+      auto [v_idx, did_insert] = vertex_index.insert(vertex, vertex_vec.size() + 1);
+      if (did_insert) vertex_vec.push_back(vertex);
+      face_indices.push_back(v_idx);
+    }
+  }
+  return vertex_vec.size();
+}
+
+template <typename F> static double time_ms(F&& f) {
+  auto t0 = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char** argv) {
+  size_t n_triangles = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+  auto tc = make_triangles(n_triangles);
+
+  std::vector<arr3f> map_vertices, hash_vertices;
+  std::vector<size_t> map_faces, hash_faces;
+  double map_ms = time_ms([&] { index_map(tc, map_vertices, map_faces); });
+  double hash_ms = time_ms([&] { index_hash(tc, hash_vertices, hash_faces); });
+
+  if (map_vertices != hash_vertices || map_faces != hash_faces) {
+    std::cerr << "std::map and VertexIndex give different vertex indices\n";
+    return 1;
+  }
+  std::cout << tc.size() << " triangles, " << hash_vertices.size() << " vertices\n"
+    << "std::set + std::map: " << map_ms << " ms\n"
+    << "VertexIndex:         " << hash_ms << " ms (" << map_ms / hash_ms << "x)\n";
+  return 0;
+}
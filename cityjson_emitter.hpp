@@ -0,0 +1,263 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <string_view>
+#include <vector>
+
+#include <geoflow/geoflow.hpp>
+#include <nlohmann/json.hpp>
+
+#include "text_writer.hpp"
+
+namespace geoflow::nodes::basic3d
+{
+
+  // The double nearest to the shortest text that reads back to f. Stored in json like
+  // that, a value that is known to be a float, like a float attribute or a Box
+  // coordinate, is written as 12.34 instead of 12.34000015258789 at precision -1, and
+  // still reads back to f.
+  inline double shortest_double(float f) {
+    char buf[32];
+    auto end = std::to_chars(buf, buf + sizeof(buf), f).ptr;
+    double d = f;
+    std::from_chars(buf, end, d);
+    return d;
+  }
+
+  // Writes CityJSON text to a TextWriter, in the same layout as nlohmann's dump(). Takes
+  // any nlohmann::basic_json, eg. nlohmann::json or ArenaJSON.
+  // Integers, ie. the bulk of a CityJSON file in the vertices and boundaries arrays,
+  // are written straight with std::to_chars. Floats are written with a fixed number
+  // of decimals, trailing zeros removed, or with a negative precision as the shortest
+  // text that reads back to the same double. The top level transform is always
+  // written like that. Strings must be valid UTF-8, as for dump().
+  class CityJSONEmitter {
+    TextWriter& out_;
+    int precision_;
+    int indent_;
+
+    // the fixed notation buffer below fits 16 integer digits and 17 decimals
+    static constexpr int max_precision = 17;
+    static constexpr double max_fixed = 1e15;
+
+    void newline(int depth) {
+      if (indent_ < 0) return;
+      out_ << '\n';
+      for (int i = 0; i < depth * indent_; ++i) out_ << ' ';
+    }
+
+    // members of object j without the braces, returns false if there are none
+    template <typename Json> bool write_members(const Json& j, int depth, int precision) {
+      bool first = true;
+      for (auto it = j.begin(); it != j.end(); ++it) {
+        if (!first) out_ << ',';
+        first = false;
+        newline(depth + 1);
+        write_key(it.key());
+        write_value(it.value(), depth + 1, (depth == 0 && it.key() == "transform") ? -1 : precision);
+      }
+      return !first;
+    }
+
+    void write_key(std::string_view key) {
+      write_string(key);
+      out_ << (indent_ < 0 ? ":" : ": ");
+    }
+
+    template <typename Json> void write_value(const Json& j, int depth, int precision) {
+      switch (j.type()) {
+        case nlohmann::json::value_t::object:
+          out_ << '{';
+          if (write_members(j, depth, precision)) newline(depth);
+          out_ << '}';
+          break;
+        case nlohmann::json::value_t::array:
+          out_ << '[';
+          for (size_t i = 0; i < j.size(); ++i) {
+            if (i) out_ << ',';
+            newline(depth + 1);
+            write_value(j[i], depth + 1, precision);
+          }
+          if (!j.empty()) newline(depth);
+          out_ << ']';
+          break;
+        case nlohmann::json::value_t::string:
+          write_string(j.template get_ref<const typename Json::string_t&>());
+          break;
+        case nlohmann::json::value_t::boolean:
+          out_ << (j.template get<bool>() ? "true" : "false");
+          break;
+        case nlohmann::json::value_t::number_integer:
+          out_ << j.template get<typename Json::number_integer_t>();
+          break;
+        case nlohmann::json::value_t::number_unsigned:
+          out_ << j.template get<typename Json::number_unsigned_t>();
+          break;
+        case nlohmann::json::value_t::number_float:
+          write_float(j.template get<double>(), precision);
+          break;
+        default:
+          out_ << "null";
+      }
+    }
+
+    public:
+    // indent < 0 gives compact output, otherwise the output is pretty printed like dump(indent)
+    CityJSONEmitter(TextWriter& out, int precision = -1, int indent = -1)
+    : out_(out), precision_(std::min(precision, max_precision)), indent_(indent) {}
+
+    // Writes j at the output precision. If vertices is given, j must be an object and
+    // the vertices are written as its last member, without converting them to json first.
+    template <typename Json = nlohmann::json> void write(const Json& j, const std::vector<std::array<int,3>>* vertices = nullptr) {
+      if (!vertices) {
+        write_value(j, 0, precision_);
+        return;
+      }
+      out_ << '{';
+      if (write_members(j, 0, precision_)) out_ << ',';
+      newline(1);
+      write_key("vertices");
+      write_vertices(*vertices, 1);
+      newline(0);
+      out_ << '}';
+    }
+
+    // writes j with exact floats
+    template <typename Json = nlohmann::json> void write_exact(const Json& j) {
+      write_value(j, 0, -1);
+    }
+
+    template <typename Vertex> void write_vertices(const std::vector<Vertex>& vertices, int depth = 0) {
+      out_ << '[';
+      for (size_t i = 0; i < vertices.size(); ++i) {
+        if (i) out_ << ',';
+        newline(depth + 1);
+        out_ << '[';
+        for (size_t k = 0; k < 3; ++k) {
+          if (k) out_ << ',';
+          newline(depth + 2);
+          out_ << vertices[i][k];
+        }
+        newline(depth + 1);
+        out_ << ']';
+      }
+      if (!vertices.empty()) newline(depth);
+      out_ << ']';
+    }
+
+    // writes v at the output precision
+    void write_float(double v) { write_float(v, precision_); }
+
+    void write_float(double v, int precision) {
+      // like dump()
+      if (!std::isfinite(v)) {
+        out_ << "null";
+        return;
+      }
+      char buf[64];
+      char* end;
+      if (precision < 0 || std::abs(v) >= max_fixed) {
+        end = std::to_chars(buf, buf + sizeof(buf), v).ptr;
+        // keep it a float, ie. 12.0 instead of 12
+        if (std::find_if(buf, end, [](char c) { return c == '.' || c == 'e'; }) == end) {
+          *end++ = '.';
+          *end++ = '0';
+        }
+      } else {
+        end = std::to_chars(buf, buf + sizeof(buf), v, std::chars_format::fixed, precision).ptr;
+        if (precision == 0) {
+          *end++ = '.';
+          *end++ = '0';
+        } else {
+          while (end[-1] == '0' && end[-2] != '.') --end;
+        }
+        // values that round to zero are written without sign
+        if (buf[0] == '-' && std::all_of(buf + 1, end, [](char c) { return c == '0' || c == '.'; })) {
+          out_ << std::string_view(buf + 1, end - buf - 1);
+          return;
+        }
+      }
+      out_ << std::string_view(buf, end - buf);
+    }
+
+    // a JSON string, escaped like dump() does, throws gfIOError for invalid UTF-8
+    void write_string(std::string_view s) {
+      static const char* hex = "0123456789abcdef";
+      out_ << '"';
+      size_t run = 0;
+      for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = s[i];
+        if (c >= 0x80) {
+          i += utf8_sequence_length(s, i) - 1;
+          continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        out_ << s.substr(run, i - run);
+        run = i + 1;
+        switch (c) {
+          case '"': out_ << "\\\""; break;
+          case '\\': out_ << "\\\\"; break;
+          case '\b': out_ << "\\b"; break;
+          case '\f': out_ << "\\f"; break;
+          case '\n': out_ << "\\n"; break;
+          case '\r': out_ << "\\r"; break;
+          case '\t': out_ << "\\t"; break;
+          default:
+            out_ << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+        }
+      }
+      out_ << s.substr(run) << '"';
+    }
+
+    private:
+    // length of the multi-byte UTF-8 sequence at s[i], see the table in RFC 3629
+    static size_t utf8_sequence_length(std::string_view s, size_t i) {
+      unsigned char c = s[i];
+      size_t n;
+      unsigned char lo = 0x80, hi = 0xBF;
+      if (c >= 0xC2 && c <= 0xDF) n = 2;
+      else if (c >= 0xE0 && c <= 0xEF) {
+        n = 3;
+        if (c == 0xE0) lo = 0xA0;
+        if (c == 0xED) hi = 0x9F;
+      } else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        if (c == 0xF0) lo = 0x90;
+        if (c == 0xF4) hi = 0x8F;
+      } else {
+        n = 0;
+      }
+      // the first continuation byte has the narrower range
+      bool valid = n > 0 && i + n <= s.size();
+      for (size_t k = 1; valid && k < n; ++k) {
+        unsigned char b = s[i + k];
+        valid = k == 1 ? (b >= lo && b <= hi) : (b >= 0x80 && b <= 0xBF);
+      }
+      if (!valid) {
+        char byte[3] = {hex_digit(c >> 4), hex_digit(c & 0xf), 0};
+        throw(gfIOError("invalid UTF-8 byte at index " + std::to_string(i) + ": 0x" + byte));
+      }
+      return n;
+    }
+
+    static char hex_digit(unsigned v) { return "0123456789ABCDEF"[v]; }
+  };
+
+} // namespace geoflow::nodes::basic3d
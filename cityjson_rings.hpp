@@ -0,0 +1,69 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace geoflow::nodes::basic3d
+{
+
+  // A vertex in integer multiples of the scale of a CityJSON transform. 64 bit, because
+  // the CityJSONWriter quantizes absolute coordinates and only translates at the end.
+  typedef std::array<int64_t,3> QuantizedVertex;
+
+  // p on the integer grid of a CityJSON transform, ie. round((p - translate) / scale)
+  template <typename Point> QuantizedVertex quantize_cityjson_vertex(const Point& p, const std::array<double,3>& translate, const std::array<double,3>& scale) {
+    return {
+      std::llround((p[0] - translate[0]) / scale[0]),
+      std::llround((p[1] - translate[1]) / scale[1]),
+      std::llround((p[2] - translate[2]) / scale[2])
+    };
+  }
+
+  // Drops the vertices of a quantized ring that are the same as their predecessor, and
+  // the ones at the end that are the same as the first, as the ring is closed
+  // implicitly. Returns false if less than 3 vertices are left, ie. the ring is
+  // degenerate, eg. a sliver smaller than the grid.
+  inline bool simplify_cityjson_ring(std::vector<QuantizedVertex>& ring) {
+    size_t n = 0;
+    for (size_t i = 0; i < ring.size(); ++i) {
+      if (n == 0 || ring[n - 1] != ring[i]) ring[n++] = ring[i];
+    }
+    while (n > 1 && ring[n - 1] == ring[0]) --n;
+    ring.resize(n);
+    return n >= 3;
+  }
+
+  // Removes the surfaces with an empty boundary, ie. a degenerate exterior ring, from
+  // a CityJSON shell or MultiSurface and returns the semantic values of the surfaces
+  // that are left. labels has one value per surface of the input.
+  template <typename Boundaries, typename Label> std::vector<Label> drop_degenerate_surfaces(Boundaries& surfaces, const std::vector<Label>& labels) {
+    std::vector<Label> values;
+    values.reserve(labels.size());
+    size_t n = 0;
+    for (size_t i = 0; i < surfaces.size(); ++i) {
+      if (surfaces[i].empty()) continue;
+      if (i < labels.size()) values.push_back(labels[i]);
+      if (n != i) surfaces[n] = std::move(surfaces[i]);
+      ++n;
+    }
+    surfaces.resize(n);
+    return values;
+  }
+
+} // namespace geoflow::nodes::basic3d
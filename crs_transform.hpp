@@ -0,0 +1,230 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+#include <geoflow/geoflow.hpp>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace geoflow::nodes::basic3d
+{
+
+  // Coordinates in structure of arrays layout, so that all points of a ring,
+  // feature or terminal can be passed to a CRSTransform together.
+  struct CoordBatch {
+    std::vector<double> x, y, z;
+
+    size_t size() const { return x.size(); }
+    bool empty() const { return x.empty(); }
+    void clear() {
+      x.clear();
+      y.clear();
+      z.clear();
+    }
+    void reserve(size_t n) {
+      x.reserve(n);
+      y.reserve(n);
+      z.reserve(n);
+    }
+    void push_back(double px, double py, double pz) {
+      x.push_back(px);
+      y.push_back(py);
+      z.push_back(pz);
+    }
+    template <typename P> void push_back(const P& p) { push_back(p[0], p[1], p[2]); }
+
+    arr3d operator[](size_t i) const { return {x[i], y[i], z[i]}; }
+    arr3f get_float(size_t i) const { return {float(x[i]), float(y[i]), float(z[i])}; }
+  };
+
+  // Wrapper around the CRS transforms of the NodeManager that takes the points of
+  // a CoordBatch together. transform_rev() goes from the process CRS to the CRS
+  // that was set with set_rev_crs_transform(), transform_fwd() from the CRS that
+  // was set with set_fwd_crs_transform() to the process CRS.
+  // The NodeManager only offers per point transforms, so a batch that needs PROJ
+  // still costs one NodeManager call per point. The gain is in the common cases
+  // below, where no NodeManager call is made at all.
+  //
+  // Often both CRSs are the same and the transform only applies the data offset.
+  // This is detected from the first points that are transformed in each direction.
+  // Those go through the NodeManager as usual and the results are compared with the
+  // translation by the data offset, which is read after the call because a forward
+  // transform sets the data offset from its first point if it was not set yet.
+  // Once min_verified points matched exactly, further points are translated inline,
+  // or left as they are for a zero offset. A single mismatch selects the NodeManager
+  // (ie. PROJ) for all further points. So the transforms must not be changed during
+  // a run, see start_run().
+  //
+  // A node keeps its CRSTransform between runs, so that nodes that run once per
+  // feature do not check min_verified points again in every run. start_run() keeps
+  // the detected paths as long as the CRS pair and the data offset stay the same.
+  // The number of points that took each path in a run is printed with report().
+  //
+  // The NodeManager owns the only PROJ context, which is not thread-safe, and this
+  // plugin has no PROJ context of its own. So the PROJ path and the detection are
+  // single threaded: transform_rev() may only be called by several threads at once
+  // while rev_is_fast(), which makes no NodeManager call. See write_cityobjects().
+  class CRSTransform {
+    public:
+    enum Path { UNKNOWN, IDENTITY, TRANSLATE, PROJ };
+
+    private:
+    NodeManager& manager_;
+    Path rev_path_ = UNKNOWN;
+    Path fwd_path_ = UNKNOWN;
+    // number of points that matched the translation while the path is UNKNOWN
+    size_t rev_verified_ = 0;
+    size_t fwd_verified_ = 0;
+    arr3d rev_offset_ = {0, 0, 0};
+    arr3d fwd_offset_ = {0, 0, 0};
+    // the CRS pair of the detected paths
+    std::string crs_pair_;
+    // points per path in this run, the points that go through the NodeManager while
+    // the path is UNKNOWN are counted as PROJ. Atomic for the threads on a fast path.
+    std::atomic<size_t> identity_points_{0};
+    std::atomic<size_t> translate_points_{0};
+    std::atomic<size_t> proj_points_{0};
+
+    static constexpr size_t min_verified = 64;
+
+    arr3d data_offset() const {
+      auto& offset = manager_.data_offset();
+      return offset.has_value() ? *offset : arr3d{0, 0, 0};
+    }
+
+    static Path fast_path(const arr3d& t) {
+      return (t[0] == 0 && t[1] == 0 && t[2] == 0) ? IDENTITY : TRANSLATE;
+    }
+
+    // a detected path that is still valid for the data offset of the NodeManager. A
+    // forward transform sets a missing data offset, so then the path is detected again.
+    bool keep_path(Path path, const arr3d& path_offset, bool needs_offset) const {
+      if (path == PROJ) return true;
+      if (path == UNKNOWN) return false;
+      if (needs_offset && !manager_.data_offset().has_value()) return false;
+      return data_offset() == path_offset;
+    }
+
+    void count(Path path, size_t n) {
+      if (path == IDENTITY) identity_points_.fetch_add(n, std::memory_order_relaxed);
+      else if (path == TRANSLATE) translate_points_.fetch_add(n, std::memory_order_relaxed);
+      else proj_points_.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // the NodeManager transforms, checking the results while the path is UNKNOWN
+    void manager_rev(CoordBatch& batch) {
+      for (size_t i = 0; i < batch.size(); ++i) {
+        auto p = batch.get_float(i);
+        auto q = manager_.coord_transform_rev(p);
+        if (rev_path_ == UNKNOWN) {
+          auto t = data_offset();
+          if (q == arr3d{p[0] + t[0], p[1] + t[1], p[2] + t[2]}) ++rev_verified_;
+          else rev_path_ = PROJ;
+        }
+        batch.x[i] = q[0];
+        batch.y[i] = q[1];
+        batch.z[i] = q[2];
+      }
+      if (rev_path_ == UNKNOWN && rev_verified_ >= min_verified) {
+        rev_offset_ = data_offset();
+        rev_path_ = fast_path(rev_offset_);
+      }
+    }
+
+    void manager_fwd(CoordBatch& batch) {
+      for (size_t i = 0; i < batch.size(); ++i) {
+        auto q = manager_.coord_transform_fwd(batch.x[i], batch.y[i], batch.z[i]);
+        if (fwd_path_ == UNKNOWN) {
+          auto t = data_offset();
+          if (q == arr3f{float(batch.x[i] - t[0]), float(batch.y[i] - t[1]), float(batch.z[i] - t[2])}) ++fwd_verified_;
+          else fwd_path_ = PROJ;
+        }
+        batch.x[i] = q[0];
+        batch.y[i] = q[1];
+        batch.z[i] = q[2];
+      }
+      if (fwd_path_ == UNKNOWN && fwd_verified_ >= min_verified) {
+        fwd_offset_ = data_offset();
+        fwd_path_ = fast_path(fwd_offset_);
+      }
+    }
+
+    public:
+    explicit CRSTransform(NodeManager& manager) : manager_(manager) {}
+
+    CRSTransform(const CRSTransform&) = delete;
+    CRSTransform& operator=(const CRSTransform&) = delete;
+
+    // Call at the start of every run of the node, after its transforms are set.
+    // crs_pair identifies the source and target CRS, eg. the CRS that the node passed
+    // to set_rev_crs_transform(). Not thread-safe.
+    void start_run(const std::string& crs_pair) {
+      if (crs_pair != crs_pair_ || !keep_path(rev_path_, rev_offset_, false)) {
+        rev_path_ = UNKNOWN;
+        rev_verified_ = 0;
+      }
+      if (crs_pair != crs_pair_ || !keep_path(fwd_path_, fwd_offset_, true)) {
+        fwd_path_ = UNKNOWN;
+        fwd_verified_ = 0;
+      }
+      crs_pair_ = crs_pair;
+      identity_points_ = 0;
+      translate_points_ = 0;
+      proj_points_ = 0;
+    }
+
+    // true once the reverse path is known to be the identity or a translation
+    bool rev_is_fast() const { return rev_path_ == IDENTITY || rev_path_ == TRANSLATE; }
+
+    // prints the number of points per path since start_run()
+    void report(const std::string& node_name) const {
+      std::cout << node_name << " CRS transform: " << identity_points_ << " identity, "
+                << translate_points_ << " translate, " << proj_points_ << " PROJ points\n";
+    }
+
+    void transform_rev(CoordBatch& batch) {
+      Path path = rev_path_;
+      count(path, batch.size());
+      if (path == IDENTITY) return;
+      if (path == TRANSLATE) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+          batch.x[i] += rev_offset_[0];
+          batch.y[i] += rev_offset_[1];
+          batch.z[i] += rev_offset_[2];
+        }
+        return;
+      }
+      manager_rev(batch);
+    }
+
+    // the results are rounded to float, like the process coordinates
+    void transform_fwd(CoordBatch& batch) {
+      Path path = fwd_path_;
+      count(path, batch.size());
+      if (path == IDENTITY || path == TRANSLATE) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+          batch.x[i] = float(batch.x[i] - fwd_offset_[0]);
+          batch.y[i] = float(batch.y[i] - fwd_offset_[1]);
+          batch.z[i] = float(batch.z[i] - fwd_offset_[2]);
+        }
+        return;
+      }
+      manager_fwd(batch);
+    }
+  };
+
+} // namespace geoflow::nodes::basic3d
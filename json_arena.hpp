@@ -0,0 +1,287 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace geoflow::nodes::basic3d
+{
+
+  // Monotonic memory for short lived json documents, eg. one CityJSONFeature. Memory
+  // is handed out from large blocks and only given back all at once with reset(). The
+  // blocks used since the previous reset() are kept for reuse, so a loop that resets
+  // the arena per feature stops allocating once the largest feature has been seen, and
+  // holds on to no more than that. See ArenaJSON.
+  class JSONArena {
+    struct Block {
+      std::unique_ptr<char[]> data;
+      size_t size;
+    };
+    std::vector<Block> blocks_;
+    size_t block_ = 0;
+    size_t pos_ = 0;
+    size_t block_size_;
+
+    void next_block(size_t n) {
+      // blocks kept by reset() are reused, skipping the ones that are too small
+      size_t next = blocks_.empty() ? 0 : block_ + 1;
+      while (next < blocks_.size() && blocks_[next].size < n) ++next;
+      if (next == blocks_.size()) {
+        size_t size = std::max(block_size_, n);
+        blocks_.push_back({std::unique_ptr<char[]>(new char[size]), size});
+      }
+      block_ = next;
+      pos_ = 0;
+    }
+
+    public:
+    // the arena of the JSONArenaScope of this thread, nullptr if there is none
+    static inline thread_local JSONArena* current = nullptr;
+
+    explicit JSONArena(size_t block_size = 1 << 16) : block_size_(block_size) {}
+
+    JSONArena(JSONArena&&) = default;
+    JSONArena(const JSONArena&) = delete;
+    JSONArena& operator=(const JSONArena&) = delete;
+
+    // n bytes, 16 byte aligned
+    void* allocate(size_t n) {
+      n = (n + 15) & ~size_t(15);
+      if (blocks_.empty() || pos_ + n > blocks_[block_].size) next_block(n);
+      void* p = blocks_[block_].data.get() + pos_;
+      pos_ += n;
+      return p;
+    }
+
+    // Makes all memory available again and frees the blocks that were not used since
+    // the previous reset(). Nothing that was allocated from the arena may be used after
+    // this, including its destructor.
+    void reset() {
+      if (!blocks_.empty()) blocks_.resize(block_ + 1);
+      block_ = 0;
+      pos_ = 0;
+    }
+  };
+
+  // Makes arena the arena of this thread for its lifetime. Scopes can be nested.
+  class JSONArenaScope {
+    JSONArena* previous_;
+
+    public:
+    explicit JSONArenaScope(JSONArena& arena) : previous_(JSONArena::current) {
+      JSONArena::current = &arena;
+    }
+    ~JSONArenaScope() { JSONArena::current = previous_; }
+
+    JSONArenaScope(const JSONArenaScope&) = delete;
+    JSONArenaScope& operator=(const JSONArenaScope&) = delete;
+  };
+
+  // Allocates from the arena of the current JSONArenaScope, or from the heap outside of
+  // one. nlohmann::basic_json default constructs its allocators, so the arena can not
+  // be a member. Instead every allocation starts with a header that records its arena,
+  // which lets any instance free any allocation: heap memory is deleted, arena memory
+  // is left for JSONArena::reset().
+  template <typename T> struct JSONArenaAllocator {
+    typedef T value_type;
+    static constexpr size_t header_size = 16;
+
+    JSONArenaAllocator() = default;
+    template <typename U> JSONArenaAllocator(const JSONArenaAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+      static_assert(alignof(T) <= header_size, "unsupported alignment");
+      JSONArena* arena = JSONArena::current;
+      size_t size = header_size + n * sizeof(T);
+      char* p = static_cast<char*>(arena ? arena->allocate(size) : ::operator new(size));
+      std::memcpy(p, &arena, sizeof(arena));
+      return reinterpret_cast<T*>(p + header_size);
+    }
+
+    void deallocate(T* p, size_t) {
+      char* base = reinterpret_cast<char*>(p) - header_size;
+      JSONArena* arena;
+      std::memcpy(&arena, base, sizeof(arena));
+      if (!arena) ::operator delete(base);
+    }
+
+    template <typename U> bool operator==(const JSONArenaAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const JSONArenaAllocator<U>&) const { return false; }
+  };
+
+  // Object type for nlohmann::basic_json that keeps its members in one vector sorted by
+  // key, instead of a node per member like std::map. Iteration order, and thus the
+  // serialized text, is the same as with std::map. The interface is that of
+  // nlohmann::ordered_map, which basic_json relies on.
+  template <class Key, class T, class IgnoredLess = std::less<Key>,
+            class Allocator = std::allocator<std::pair<const Key, T>>>
+  struct JSONSortedMap : std::vector<std::pair<const Key, T>, Allocator> {
+    using key_type = Key;
+    using mapped_type = T;
+    using Container = std::vector<std::pair<const Key, T>, Allocator>;
+    using iterator = typename Container::iterator;
+    using const_iterator = typename Container::const_iterator;
+    using size_type = typename Container::size_type;
+    using value_type = typename Container::value_type;
+    // not transparent, so basic_json converts all keys to key_type
+    using key_compare = std::less<Key>;
+
+    JSONSortedMap() noexcept(noexcept(Container())) : Container{} {}
+    explicit JSONSortedMap(const Allocator& alloc) noexcept(noexcept(Container(alloc))) : Container{alloc} {}
+    template <class It>
+    JSONSortedMap(It first, It last, const Allocator& alloc = Allocator()) : Container{alloc} {
+      insert(first, last);
+    }
+    JSONSortedMap(std::initializer_list<value_type> init, const Allocator& alloc = Allocator()) : Container{alloc} {
+      insert(init.begin(), init.end());
+    }
+
+    iterator lower_bound(const key_type& key) {
+      return std::lower_bound(this->begin(), this->end(), key,
+        [](const value_type& v, const key_type& k) { return key_compare()(v.first, k); });
+    }
+    const_iterator lower_bound(const key_type& key) const {
+      return std::lower_bound(this->begin(), this->end(), key,
+        [](const value_type& v, const key_type& k) { return key_compare()(v.first, k); });
+    }
+
+    std::pair<iterator, bool> emplace(const key_type& key, T&& t) {
+      auto it = lower_bound(key);
+      if (it != this->end() && !key_compare()(key, it->first)) {
+        return {it, false};
+      }
+      return {insert_at(it, key, std::forward<T>(t)), true};
+    }
+
+    T& operator[](const key_type& key) {
+      return emplace(key, T{}).first->second;
+    }
+
+    const T& operator[](const key_type& key) const {
+      return at(key);
+    }
+
+    T& at(const key_type& key) {
+      auto it = find(key);
+      if (it == this->end()) throw std::out_of_range("key not found");
+      return it->second;
+    }
+
+    const T& at(const key_type& key) const {
+      auto it = find(key);
+      if (it == this->end()) throw std::out_of_range("key not found");
+      return it->second;
+    }
+
+    size_type erase(const key_type& key) {
+      auto it = find(key);
+      if (it == this->end()) return 0;
+      erase(it);
+      return 1;
+    }
+
+    iterator erase(iterator pos) {
+      return erase(pos, std::next(pos));
+    }
+
+    iterator erase(iterator first, iterator last) {
+      if (first == last) return first;
+      const auto n = std::distance(first, last);
+      const auto offset = std::distance(Container::begin(), first);
+      // keys are const, so the elements after the erased ones are re-constructed in place
+      for (auto it = first; std::next(it, n) != Container::end(); ++it) {
+        it->~value_type();
+        new (&*it) value_type{std::move(*std::next(it, n))};
+      }
+      Container::resize(this->size() - static_cast<size_type>(n));
+      return Container::begin() + offset;
+    }
+
+    size_type count(const key_type& key) const {
+      return find(key) == this->end() ? 0 : 1;
+    }
+
+    iterator find(const key_type& key) {
+      auto it = lower_bound(key);
+      return (it != this->end() && !key_compare()(key, it->first)) ? it : this->end();
+    }
+
+    const_iterator find(const key_type& key) const {
+      auto it = lower_bound(key);
+      return (it != this->end() && !key_compare()(key, it->first)) ? it : this->end();
+    }
+
+    std::pair<iterator, bool> insert(value_type&& value) {
+      return emplace(value.first, std::move(value.second));
+    }
+
+    std::pair<iterator, bool> insert(const value_type& value) {
+      auto it = lower_bound(value.first);
+      if (it != this->end() && !key_compare()(value.first, it->first)) {
+        return {it, false};
+      }
+      return {insert_at(it, value), true};
+    }
+
+    template <typename InputIt>
+    using require_input_iter = typename std::enable_if<std::is_convertible<typename std::iterator_traits<InputIt>::iterator_category,
+            std::input_iterator_tag>::value>::type;
+
+    template <typename InputIt, typename = require_input_iter<InputIt>>
+    void insert(InputIt first, InputIt last) {
+      for (auto it = first; it != last; ++it) {
+        insert(*it);
+      }
+    }
+
+    private:
+    // constructs an element at the end and moves it to pos, shifting the ones after pos
+    template <typename... Args> iterator insert_at(iterator pos, Args&&... args) {
+      const auto offset = size_type(std::distance(Container::begin(), pos));
+      Container::emplace_back(std::forward<Args>(args)...);
+      auto& elements = static_cast<Container&>(*this);
+      if (offset + 1 < elements.size()) {
+        value_type inserted{std::move(elements.back())};
+        for (size_type i = elements.size() - 1; i > offset; --i) {
+          elements[i].~value_type();
+          new (&elements[i]) value_type{std::move(elements[i - 1])};
+        }
+        elements[offset].~value_type();
+        new (&elements[offset]) value_type{std::move(inserted)};
+      }
+      return Container::begin() + offset;
+    }
+  };
+
+  // json for short lived documents: objects are JSONSortedMaps, and arrays, objects and
+  // the string values themselves are allocated from the JSONArena of the current
+  // JSONArenaScope. The text of strings is on the heap as usual. Converts to and from
+  // nlohmann::json, and serializes exactly like it.
+  typedef nlohmann::basic_json<JSONSortedMap, std::vector, std::string, bool, std::int64_t,
+                               std::uint64_t, double, JSONArenaAllocator> ArenaJSON;
+
+} // namespace geoflow::nodes::basic3d
@@ -17,11 +17,15 @@
 #include <fstream>
 #include <iomanip>
 #include <filesystem>
+#include <optional>
 
 #include <geoflow/geoflow.hpp>
 
 #include <nlohmann/json.hpp>
 
+#include "crs_transform.hpp"
+#include "text_writer.hpp"
+
 namespace fs = std::filesystem;
 
 namespace geoflow::nodes::basic3d
@@ -52,22 +56,84 @@ public:
   }
 };
 
+struct PLYColumn;
+
 class PLYWriterNode : public Node
 {
   std::string filepath;
   bool no_offset = false;
   bool write_ascii = false;
+  bool append = false;
+
+  // state of the file that is appended to in append mode
+  std::ofstream append_ofs;
+  std::string append_fname;
+  std::string append_properties;
+  std::streampos append_count_pos;
+  size_t append_count = 0;
+
+  void append_to_file(const std::string& fname, const PointCollection& points, const std::vector<PLYColumn>& columns);
 
 public:
   using Node::Node;
   void init() override
   {
     add_input("geometries", typeid(PointCollection));
-    add_poly_input("attributes", {typeid(float)});
+    add_poly_input("attributes", {typeid(float), typeid(int), typeid(bool), typeid(uint8_t), typeid(double)});
 
     add_param(ParamPath(filepath, "filepath", "File path"));
     add_param(ParamBool(no_offset, "no_offset", "Do not apply global offset"));
     add_param(ParamBool(write_ascii, "write_ascii", "Output as ascii file instead of binary"));
+    add_param(ParamBool(append, "append", "Keep the file open and append the points of every run to it, instead of overwriting it. A new file is started when the file path changes. Only for binary output."));
+  }
+  void process() override;
+  bool parameters_valid() override {
+    if (manager.substitute_globals(filepath).empty())
+      return false;
+    else if (append && write_ascii)
+      return false;
+    else
+      return true;
+  }
+};
+
+class PLYMeshWriterNode : public Node
+{
+  std::string filepath;
+  bool no_offset = false;
+
+public:
+  using Node::Node;
+  void init() override
+  {
+    add_vector_input("triangles", {typeid(TriangleCollection), typeid(MultiTriangleCollection)});
+
+    add_param(ParamPath(filepath, "filepath", "File path"));
+    add_param(ParamBool(no_offset, "no_offset", "Do not apply global offset. With the offset applied the vertices are written as double instead of float."));
+  }
+  void process() override;
+  bool parameters_valid() override {
+    if (manager.substitute_globals(filepath).empty())
+      return false;
+    else
+      return true;
+  }
+};
+
+class PLYReaderNode : public Node
+{
+  std::string filepath;
+  int n_threads = 0;
+
+public:
+  using Node::Node;
+  void init() override
+  {
+    add_output("points", typeid(PointCollection));
+    add_poly_output("attributes", {typeid(float), typeid(int), typeid(uint8_t), typeid(double)});
+
+    add_param(ParamPath(filepath, "filepath", "File path"));
+    add_param(ParamInt(n_threads, "n_threads", "Number of threads used to decode binary files. 0 means one per available core."));
   }
   void process() override;
   bool parameters_valid() override {
@@ -85,6 +151,8 @@ class VecOBJWriterNode : public Node
   std::string headerline_;
   std::string attribute_name = "identificatie";
   bool no_offset = false;
+  bool streaming = false;
+  int n_threads = 0;
 
 public:
   using Node::Node;
@@ -98,6 +166,8 @@ public:
     add_param(ParamInt(precision, "precision", "precision"));
     add_param(ParamString(attribute_name, "attribute_name", "attribute to use as identifier for obj objects. Has to be a string attribute."));
     add_param(ParamString(headerline_, "Headerline", "add this string as a comment in the header of the OBJ file"));
+    add_param(ParamBool(streaming, "streaming", "Write the vertices of each object directly before its faces. Vertices are only deduplicated within an object, but memory use is bounded by the largest object."));
+    add_param(ParamInt(n_threads, "n_threads", "Number of threads used to format MultiTriangleCollection output. 0 means one per available core."));
   }
   void process() override;
   bool parameters_valid() override {
@@ -149,10 +219,19 @@ class CityJSONWriterNode : public Node {
 
   bool prettyPrint_ = false;
   bool only_output_renamed_ = false;
+  bool streaming_ = false;
+  int precision_ = -1;
+  int n_threads_ = 0;
 
   vec1s key_options;
   StrMap output_attribute_names;
 
+  // kept between runs, so that the detected path is too, see CRSTransform
+  CRSTransform crs_transform_{manager};
+
+  nlohmann::json make_metadata(Box& bbox);
+  void write_streaming(fs::path& fname);
+
   public:
   using Node::Node;
 
@@ -182,6 +261,9 @@ class CityJSONWriterNode : public Node {
     add_param(ParamBool(prettyPrint_, "prettyPrint", "Pretty print CityJSON output"));
     add_param(ParamStrMap(output_attribute_names, key_options, "output_attribute_names", "Output attribute names"));
     add_param(ParamBool(only_output_renamed_, "only_output_renamed", "Only output renamed attributes."));
+    add_param(ParamBool(streaming_, "streaming", "Write each CityObject to the file as soon as it is complete, instead of building the whole document in memory. The vertices are spooled to a temporary file next to the output and only deduplicated within about the last half million, so memory use does not grow with the vertices of the tile. It does grow with the number of CityObjects, whose ids are kept to check that they are unique. Ignores prettyPrint and requires unique CityObject ids."));
+    add_param(ParamInt(precision_, "precision", "Number of decimals of float attributes and geographicalExtent. -1 writes the shortest text that reads back to the same value, and float attributes and extents as the shortest text that reads back to the same float."));
+    add_param(ParamInt(n_threads_, "n_threads", "Number of threads used to build the CityObjects. 0 means one per available core. The output does not depend on it."));
 
   }
 
@@ -241,6 +323,23 @@ class CityJSONFeatureWriterNode : public Node {
   float scale_y_ = 1.;
   float scale_z_ = 1.;
 
+  bool sequence_ = false;
+  int precision_ = -1;
+
+  // state of the CityJSONSeq file in sequence mode, the writer is declared after the
+  // stream so that it flushes before the stream is closed
+  std::ofstream seq_ofs_;
+  std::optional<TextWriter> seq_out_;
+  std::string seq_fname_;
+
+  // text of the last feature, the memory is reused for the next one
+  TextWriter feature_text_;
+
+  // kept between runs, so that the detected path is too, see CRSTransform
+  CRSTransform crs_transform_{manager};
+
+  void write_sequence(const std::string& fname, std::string_view feature);
+
 public:
   using Node::Node;
 
@@ -266,6 +365,8 @@ public:
     add_param(ParamFloat(scale_x_, "scale_x", "CityJSON transform.scale.x"));
     add_param(ParamFloat(scale_y_, "scale_y", "CityJSON transform.scale.y"));
     add_param(ParamFloat(scale_z_, "scale_z", "CityJSON transform.scale.z"));
+    add_param(ParamBool(sequence_, "sequence", "Append every feature as one line to a CityJSONSeq (.city.jsonl) file at filepath, instead of writing one file per feature. The first line holds the transform. The file is kept open and written in large blocks, a new file is started when the file path changes."));
+    add_param(ParamInt(precision_, "precision", "Number of decimals of float attributes. -1 writes the shortest text that reads back to the same value, and float attributes and extents as the shortest text that reads back to the same float."));
   }
 
   void on_receive(gfMultiFeatureInputTerminal& it) override {
@@ -385,6 +486,11 @@ class CityJSONLinesWriterNode : public Node {
   bool prettyPrint_ = false;
   bool optimal_lod_ = false;
   bool recompute_offset_ = false;
+  bool streaming_ = false;
+  int precision_ = -1;
+  int n_threads_ = 0;
+
+  void write_streaming(fs::path& fname, nlohmann::json& metajson);
 
 public:
   using Node::Node;
@@ -397,6 +503,9 @@ public:
     add_param(ParamBool(prettyPrint_, "prettyPrint", "Pretty print CityJSON output"));
     add_param(ParamBool(optimal_lod_, "optimal_lod", "Only output optimal lod"));
     add_param(ParamBool(recompute_offset_, "recompute_offset", "Recompute vertex translation based on bounding box of data."));
+    add_param(ParamInt(precision_, "precision", "Number of decimals of float attributes and geographicalExtent. -1 writes the shortest text that reads back to the same value, and float attributes and extents as the shortest text that reads back to the same float."));
+    add_param(ParamBool(streaming_, "streaming", "Write the CityObjects of each feature to the file as soon as it is parsed, instead of collecting the whole tile in memory. The vertices are spooled to a temporary file next to the output. Ignores prettyPrint and requires unique CityObject ids."));
+    add_param(ParamInt(n_threads_, "n_threads", "Number of threads used to parse the features. 0 means one per available core. The output does not depend on it."));
     add_param(ParamPath(filepath_, "filepath", "File path"));
   }
 
@@ -438,6 +547,9 @@ class CityJSONL2MeshNode : public Node {
   // bool filter_by_type = false;
   std::string optimal_lod_value_ = "2.2";
 
+  // kept between runs, so that the detected path is too, see CRSTransform
+  CRSTransform crs_transform_{manager};
+
 public:
   using Node::Node;
 
@@ -514,6 +626,9 @@ class GLTFWriterNode : public Node {
   std::string colorGenericCityObject = "#4F4A6A";
   std::string colorOtherConstruction = "#4F4A6A";
 
+  // kept between runs, so that the detected path is too, see CRSTransform
+  CRSTransform crs_transform_{manager};
+
 public:
   using Node::Node;
 
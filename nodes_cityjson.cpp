@@ -15,12 +15,24 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "nodes.hpp"
+#include "vertex_index.hpp"
+#include "crs_transform.hpp"
+#include "text_writer.hpp"
+#include "cityjson_emitter.hpp"
+#include "cityjson_rings.hpp"
+#include "thread_pool.hpp"
+#include "json_arena.hpp"
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <cstdint>
 #include <ctime>
 #include <geoflow/common.hpp>
 #include <geoflow/geoflow.hpp>
 #include <regex>
 #include <nlohmann/json.hpp>
 #include <string>
+#include <unordered_set>
 
 namespace geoflow::nodes::basic3d
 {
@@ -100,101 +112,579 @@ namespace geoflow::nodes::basic3d
     }
   }
 
-  template<typename T> void add_vertices_ring(std::map<arr3d, size_t>& vertex_map, std::vector<arr3d>& vertex_vec, std::set<arr3d>& vertex_set, const T& ring, NodeManager& manager, Box& bbox) {
-    size_t v_cntr = vertex_vec.size();
-    for (auto &vertex_ : ring)
-    {
-      auto vertex = manager.coord_transform_rev(vertex_);
-      bbox.add(vertex);
-      auto [it, did_insert] = vertex_set.insert(vertex);
-      if (did_insert)
-      {
-        vertex_map[vertex] = v_cntr++;
-        vertex_vec.push_back(vertex);
+  // The CityJSONWriter quantizes to whole millimeters without a translate. Its output
+  // translate is the millimeter closest to the center of the bounding box.
+  static const arr3d cityjson_mm_translate = {0, 0, 0};
+  static const arr3d cityjson_mm_scale = {0.001, 0.001, 0.001};
+
+  static arr3d cityjson_mm_to_meters(const QuantizedVertex& q) {
+    return {q[0] / 1000.0, q[1] / 1000.0, q[2] / 1000.0};
+  }
+
+  static QuantizedVertex cityjson_mm_center(Box& bbox) {
+    auto center = bbox.center();
+    return {
+      std::llround(double(center[0]) * 1000),
+      std::llround(double(center[1]) * 1000),
+      std::llround(double(center[2]) * 1000)
+    };
+  }
+
+  // Temporary file next to a streamed CityJSON output that holds its vertices until
+  // their transform is known. The file is removed when the spool is destroyed, so
+  // also when writing the output fails with an exception.
+  class CityJSONVertexSpool {
+    fs::path fname_;
+    std::fstream file_;
+    size_t size_ = 0;
+
+    public:
+    explicit CityJSONVertexSpool(const fs::path& output_fname)
+    : fname_(output_fname.string() + ".vertices.tmp"),
+      file_(fname_, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc) {
+      if (!file_.good()) {
+        throw(gfIOError("Could not open " + fname_.string() + " for writing"));
       }
     }
-  }
+    ~CityJSONVertexSpool() {
+      file_.close();
+      std::error_code ec;
+      fs::remove(fname_, ec);
+    }
+    CityJSONVertexSpool(const CityJSONVertexSpool&) = delete;
+    CityJSONVertexSpool& operator=(const CityJSONVertexSpool&) = delete;
 
-  Box add_vertices_polygon(std::map<arr3d, size_t>& vertex_map, std::vector<arr3d>& vertex_vec, std::set<arr3d>& vertex_set, const LinearRing& polygon, NodeManager& manager) {
-    Box bbox;
-    add_vertices_ring(vertex_map, vertex_vec, vertex_set, polygon, manager, bbox);
-    for (auto &iring : polygon.interior_rings()) {
-      add_vertices_ring(vertex_map, vertex_vec, vertex_set, iring, manager, bbox);
+    size_t size() const { return size_; }
+
+    void write(const std::vector<QuantizedVertex>& vertices) {
+      file_.write((const char*) vertices.data(), vertices.size() * sizeof(QuantizedVertex));
+      if (!file_.good()) {
+        throw(gfIOError("Failed writing " + fname_.string()));
+      }
+      size_ += vertices.size();
     }
-    return bbox;
-  }
 
-  Box add_vertices_mesh(std::map<arr3d, size_t>& vertex_map, std::vector<arr3d>& vertex_vec, std::set<arr3d>& vertex_set, const Mesh& mesh, NodeManager& manager) {
-    Box bbox;
-    for (auto &face : mesh.get_polygons())
-    {
-      bbox.add( add_vertices_polygon(vertex_map, vertex_vec, vertex_set, face, manager) );
+    // calls f(vertex) for every spooled vertex, in order
+    template <typename F> void read(F&& f) {
+      file_.seekg(0);
+      std::vector<QuantizedVertex> block(1 << 16);
+      for (size_t i0 = 0; i0 < size_; i0 += block.size()) {
+        size_t n = std::min(block.size(), size_ - i0);
+        file_.read((char*) block.data(), n * sizeof(QuantizedVertex));
+        if (!file_.good()) {
+          throw(gfIOError("Failed reading " + fname_.string()));
+        }
+        for (size_t i = 0; i < n; ++i) f(block[i]);
+      }
     }
-    return bbox;
-  }
+  };
+
+  // The output of the streaming CityJSON writers: the file, the TextWriter and emitter
+  // that write to it and the spool of its vertices. A CityObject can not be overwritten
+  // once it is written, so add_cityobject() throws for duplicate ids.
+  class CityJSONStream {
+    fs::path fname_;
+    std::ofstream ofs_;
+    CityJSONVertexSpool spool_;
+    std::unordered_set<std::string> ids_;
+    bool first_ = true;
+
+    static const fs::path& with_parent_directories(const fs::path& fname) {
+      fs::create_directories(fname.parent_path());
+      return fname;
+    }
+
+    public:
+    TextWriter out;
+    CityJSONEmitter emitter;
+
+    CityJSONStream(const fs::path& fname, int precision)
+    : fname_(with_parent_directories(fname)),
+      ofs_(fname_, std::ios::out | std::ios::binary),
+      spool_(fname),
+      out(ofs_),
+      emitter(out, precision) {
+      if (!ofs_.good()) {
+        throw(gfIOError("Could not open " + fname_.string() + " for writing"));
+      }
+    }
+
+    // a member of the CityObjects object, which the caller opens and closes
+    template <typename Json> void add_cityobject(const std::string& id, const Json& cityobject) {
+      if (!ids_.insert(id).second) {
+        throw(gfIOError("Duplicate CityObject id " + id + " in streaming mode"));
+      }
+      if (!first_) out << ',';
+      first_ = false;
+      emitter.write_string(id);
+      out << ':';
+      emitter.write(cityobject);
+    }
+
+    void add_vertices(const std::vector<QuantizedVertex>& vertices) { spool_.write(vertices); }
+
+    size_t n_vertices() const { return spool_.size(); }
+
+    // the elements of the vertices array, f(vertex) gives the output integers of a
+    // spooled vertex
+    template <typename F> void write_vertices(F&& f) {
+      bool first_vertex = true;
+      spool_.read([&](const QuantizedVertex& vertex) {
+        std::array<int,3> v = f(vertex);
+        if (!first_vertex) out << ',';
+        first_vertex = false;
+        out << '[' << v[0] << ',' << v[1] << ',' << v[2] << ']';
+      });
+    }
+
+    void close() {
+      out.flush();
+      if (!ofs_.good()) {
+        throw(gfIOError("Failed writing " + fname_.string()));
+      }
+    }
+  };
+
+  // Collects the vertices of the CityObjects in the output CRS. Every vertex of a
+  // set of polygons is transformed once and the vertex indices are assigned in the
+  // same pass, so the boundaries are built without a second transform or lookup.
+  // Vertices are rounded to the grid of the CityJSON transform before they are
+  // deduplicated, so points that end up on the same integer vertex share one index.
+  // Consecutive points of a ring that share an index are written once. A ring that has
+  // less than 3 vertices left is degenerate and left out, see take().
+  class CityJSONVertices {
+    CRSTransform& transform_;
+    std::vector<QuantizedVertex>& vertex_vec_;
+    arr3d translate_, scale_;
+    VertexIndex<QuantizedVertex> vertex_index_;
+    CoordBatch batch_;
+    std::vector<QuantizedVertex> ring_;
+    size_t n_vertices_ = 0;
+
+    public:
+    // transform can be shared with other threads while it is fast, see CRSTransform.
+    // New vertices are appended to vertex_vec, as round((p - translate) / scale). The
+    // caller may empty vertex_vec in between, eg. to spool the vertices to a file, the
+    // vertex indices keep counting.
+    CityJSONVertices(CRSTransform& transform, std::vector<QuantizedVertex>& vertex_vec, const arr3d& translate, const arr3d& scale)
+    : transform_(transform), vertex_vec_(vertex_vec), translate_(translate), scale_(scale) {}
+
+    // forget all vertices and start counting from 0 again
+    void clear() {
+      vertex_index_.clear();
+      vertex_vec_.clear();
+      n_vertices_ = 0;
+    }
+
+    QuantizedVertex quantize(const arr3d& p) const {
+      return quantize_cityjson_vertex(p, translate_, scale_);
+    }
+
+    typedef std::vector<std::vector<std::vector<size_t>>> Boundaries;
+
+    // Returns the boundary, ie. the vertex indices of the exterior and interior rings,
+    // of each polygon in [begin, end) and adds the vertices to bbox. The boundary of a
+    // polygon with a degenerate exterior ring is empty.
+    template<typename It> Boundaries add_polygons(It begin, It end, Box& bbox) {
+      batch_.clear();
+      queue(begin, end);
+      transform_.transform_rev(batch_);
+      size_t bi = 0;
+      return take(begin, end, bbox, bi);
+    }
+
+    // Like add_polygons() for the polygons of several meshes, with one transform_rev() call.
+    // bboxes[m] is set to the bounding box of meshes[m].
+    std::vector<Boundaries> add_meshes(const std::vector<const Mesh*>& meshes, std::vector<Box>& bboxes) {
+      batch_.clear();
+      for (auto mesh : meshes) {
+        queue(mesh->get_polygons().begin(), mesh->get_polygons().end());
+      }
+      transform_.transform_rev(batch_);
+
+      std::vector<Boundaries> shells;
+      shells.reserve(meshes.size());
+      bboxes.assign(meshes.size(), Box());
+      size_t bi = 0;
+      for (size_t m = 0; m < meshes.size(); ++m) {
+        auto& polygons = meshes[m]->get_polygons();
+        shells.push_back(take(polygons.begin(), polygons.end(), bboxes[m], bi));
+      }
+      return shells;
+    }
+
+    private:
+    // appends the rings of the polygons in [begin, end) to the batch
+    template<typename It> void queue(It begin, It end) {
+      for (auto polygon = begin; polygon != end; ++polygon) {
+        for (auto &vertex : *polygon) batch_.push_back(vertex);
+        for (auto &iring : polygon->interior_rings()) {
+          for (auto &vertex : iring) batch_.push_back(vertex);
+        }
+      }
+    }
+
+    // Assigns the vertex indices of the polygons in [begin, end), whose transformed
+    // vertices start at batch index bi. A degenerate ring, see simplify_cityjson_ring(),
+    // is left out, with its whole polygon for an exterior ring. Its vertices are not
+    // added, so every vertex is used by some ring.
+    template<typename It> Boundaries take(It begin, It end, Box& bbox, size_t& bi) {
+      Boundaries boundaries;
+      auto add_ring = [&](size_t ring_size) {
+        std::vector<size_t> indices;
+        size_t ring_begin = bi;
+        ring_.clear();
+        for (size_t ring_end = bi + ring_size; bi < ring_end; ++bi) {
+          ring_.push_back(quantize(batch_[bi]));
+        }
+        if (!simplify_cityjson_ring(ring_)) return indices;
+
+        for (size_t i = ring_begin; i < bi; ++i) bbox.add(batch_[i]);
+        indices.reserve(ring_.size());
+        for (auto& qvertex : ring_) {
+          auto [v_idx, did_insert] = vertex_index_.insert(qvertex, n_vertices_);
+          if (did_insert) {
+            vertex_vec_.push_back(qvertex);
+            ++n_vertices_;
+          }
+          indices.push_back(v_idx);
+        }
+        return indices;
+      };
+      for (auto polygon = begin; polygon != end; ++polygon) {
+        auto& jface = boundaries.emplace_back();
+        auto exterior = add_ring(polygon->size());
+        if (exterior.empty()) {
+          for (auto &iring : polygon->interior_rings()) bi += iring.size();
+          continue;
+        }
+        jface.emplace_back(std::move(exterior));
+        for (auto &iring : polygon->interior_rings()) {
+          auto interior = add_ring(iring.size());
+          if (!interior.empty()) jface.emplace_back(std::move(interior));
+        }
+      }
+      return boundaries;
+    }
+  };
+
+  // An attribute terminal resolved once per process() into its output name and
+  // value type, so the per feature loop does no name lookups or type checks.
+  struct CityJSONAttributeEncoder {
+    enum Type { BOOL, FLOAT, INT, STRING, DATE, TIME, DATETIME };
+    const gfSingleFeatureOutputTerminal* term;
+    std::string name;
+    Type type;
+
+    // Returns the encoders for the terminals of a supported type, in terminal order. If
+    // output_attribute_names is given, terminals are renamed with it (an empty new name
+    // keeps the original name), and with only_output_renamed the others are skipped.
+    static std::vector<CityJSONAttributeEncoder> compile(
+      gfMultiFeatureInputTerminal& attributes,
+      const StrMap* output_attribute_names = nullptr,
+      bool only_output_renamed = false
+    ) {
+      std::vector<CityJSONAttributeEncoder> encoders;
+      for (auto& term : attributes.sub_terminals()) {
+        auto tname = term->get_full_name();
+
+        //see if we need to rename this attribute
+        if (output_attribute_names) {
+          auto search = output_attribute_names->find(tname);
+          if(search != output_attribute_names->end()) {
+            //ignore if the new name is an empty string
+            if(search->second.size()!=0)
+              tname = search->second;
+          } else if (only_output_renamed) {
+            continue;
+          }
+        }
+
+        Type type;
+        if (term->accepts_type(typeid(bool))) type = BOOL;
+        else if (term->accepts_type(typeid(float))) type = FLOAT;
+        else if (term->accepts_type(typeid(int))) type = INT;
+        else if (term->accepts_type(typeid(std::string))) type = STRING;
+        else if (term->accepts_type(typeid(Date))) type = DATE;
+        else if (term->accepts_type(typeid(Time))) type = TIME;
+        else if (term->accepts_type(typeid(DateTime))) type = DATETIME;
+        else continue;
+        encoders.push_back({term, tname, type});
+      }
+      return encoders;
+    }
+
+    // Returns the last encoder with the given name that can provide an identifier, or nullptr
+    static const CityJSONAttributeEncoder* find_identifier(const std::vector<CityJSONAttributeEncoder>& encoders, const std::string& name) {
+      const CityJSONAttributeEncoder* found = nullptr;
+      for (auto& encoder : encoders) {
+        if (encoder.name == name && (encoder.type == FLOAT || encoder.type == INT || encoder.type == STRING)) {
+          found = &encoder;
+        }
+      }
+      return found;
+    }
+
+    bool has_value(size_t i) const {
+      return term->get_data_vec()[i].has_value();
+    }
+
+    // value i of a DATE, TIME or DATETIME encoder with a value
+    std::string date_string(size_t i) const {
+      switch (type) {
+        // for date/time we follow https://en.wikipedia.org/wiki/ISO_8601
+        case DATE: return term->get<const Date&>(i).format_to_ietf();
+        case TIME: {
+          auto& t = term->get<const Time&>(i);
+          return std::to_string(t.hour) + ":" + std::to_string(t.minute) + ":" + std::to_string(t.second) + "Z";
+        }
+        default: return term->get<const DateTime&>(i).format_to_ietf();
+      }
+    }
+
+    // value i as json, null if there is no value
+    ArenaJSON encode(size_t i) const {
+      if (!has_value(i)) return nullptr;
+      switch (type) {
+        case BOOL: return term->get<const bool&>(i);
+        case FLOAT: return shortest_double(term->get<const float&>(i));
+        case INT: return term->get<const int&>(i);
+        case STRING: return term->get<const std::string&>(i);
+        default: return date_string(i);
+      }
+    }
+
+    // writes value i as the text of encode(i)
+    void write(CityJSONEmitter& emitter, TextWriter& out, size_t i) const {
+      if (!has_value(i)) {
+        out << "null";
+        return;
+      }
+      switch (type) {
+        case BOOL: out << (term->get<const bool&>(i) ? "true" : "false"); break;
+        case FLOAT: emitter.write_float(shortest_double(term->get<const float&>(i))); break;
+        case INT: out << term->get<const int&>(i); break;
+        case STRING: emitter.write_string(term->get<const std::string&>(i)); break;
+        default: emitter.write_string(date_string(i));
+      }
+    }
+
+    // The encoders in the order of the members of a json object, ie. sorted by name.
+    // Of encoders with the same name only the last one is kept, as it replaces the
+    // others in the object.
+    static std::vector<const CityJSONAttributeEncoder*> members(const std::vector<CityJSONAttributeEncoder>& encoders) {
+      std::vector<const CityJSONAttributeEncoder*> members;
+      for (auto& encoder : encoders) members.push_back(&encoder);
+      std::stable_sort(members.begin(), members.end(), [](auto a, auto b) { return a->name < b->name; });
+      size_t n = 0;
+      for (size_t k = 0; k < members.size(); ++k) {
+        if (n > 0 && members[n - 1]->name == members[k]->name) --n;
+        members[n++] = members[k];
+      }
+      members.resize(n);
+      return members;
+    }
+
+    // writes the attributes object of feature i, members as returned by members()
+    static void write_object(const std::vector<const CityJSONAttributeEncoder*>& members, CityJSONEmitter& emitter, TextWriter& out, size_t i) {
+      out << '{';
+      for (size_t k = 0; k < members.size(); ++k) {
+        if (k) out << ',';
+        emitter.write_string(members[k]->name);
+        out << ':';
+        members[k]->write(emitter, out, i);
+      }
+      out << '}';
+    }
+
+    // value i as CityObject identifier, only for FLOAT, INT and STRING encoders with a value
+    std::string id_string(size_t i) const {
+      switch (type) {
+        case FLOAT: return std::to_string(term->get<const float&>(i));
+        case INT: return std::to_string(term->get<const int&>(i));
+        default: return term->get<const std::string&>(i);
+      }
+    }
+  };
 
+  // The geometry inputs of the CityJSON writers, resolved once per process(). Building
+  // i has a footprint and, if has_solids(i), a BuildingPart per sid of the MeshMap of
+  // its highest LoD, with a Mesh for every exported LoD.
+  class CityJSONBuildingInputs {
+    public:
+    typedef std::unordered_map<int, Mesh> MeshMap;
+
+    struct Part {
+      int sid;
+      // the part attributes are indexed by the BuildingParts of all Buildings, in the
+      // order of their MeshMaps
+      size_t attribute_index;
+      std::vector<const Mesh*> meshes;
+      std::vector<const char*> lods;
+    };
+
+    private:
+    gfSingleFeatureInputTerminal& footprints_;
+    gfSingleFeatureInputTerminal& lod12_;
+    gfSingleFeatureInputTerminal& lod13_;
+    gfSingleFeatureInputTerminal& lod22_;
+    bool export_lod12_, export_lod13_, export_lod22_;
+    size_t size_ = 0;
+    std::vector<size_t> first_part_;
+
+    // the MeshMap of Building i for a LoD, nullptr if it has none
+    const MeshMap* meshmap(gfSingleFeatureInputTerminal& term, bool export_lod, size_t i) const {
+      if (!export_lod || !term.get_data_vec()[i].has_value()) return nullptr;
+      return &term.get<const MeshMap&>(i);
+    }
+
+    const MeshMap& part_meshmap(size_t i) const {
+      if (export_lod22_) return lod22_.get<const MeshMap&>(i);
+      if (export_lod13_) return lod13_.get<const MeshMap&>(i);
+      return lod12_.get<const MeshMap&>(i);
+    }
+
+    public:
+    CityJSONBuildingInputs(
+      gfSingleFeatureInputTerminal& footprints,
+      gfSingleFeatureInputTerminal& multisolids_lod12,
+      gfSingleFeatureInputTerminal& multisolids_lod13,
+      gfSingleFeatureInputTerminal& multisolids_lod22)
+    : footprints_(footprints), lod12_(multisolids_lod12), lod13_(multisolids_lod13), lod22_(multisolids_lod22),
+      // we expect at least one of the geomtry inputs is set
+      export_lod12_(multisolids_lod12.has_data()),
+      export_lod13_(multisolids_lod13.has_data()),
+      export_lod22_(multisolids_lod22.has_data()) {
+      if (export_lod12_)
+        size_ = lod12_.size();
+      else if (export_lod13_)
+        size_ = lod13_.size();
+      else if (export_lod22_)
+        size_ = lod22_.size();
+
+      first_part_.resize(size_);
+      size_t n_parts = 0;
+      for (size_t i=0; i<size_; ++i) {
+        first_part_[i] = n_parts;
+        if (has_solids(i)) n_parts += part_meshmap(i).size();
+      }
+    }
+
+    size_t size() const { return size_; }
+
+    LinearRing footprint(size_t i) const { return footprints_.get<LinearRing>(i); }
+
+    bool has_solids(size_t i) const {
+      bool has_solids = false;
+      if (export_lod12_) has_solids = lod12_.get_data_vec()[i].has_value();
+      if (export_lod13_) has_solids = lod13_.get_data_vec()[i].has_value();
+      if (export_lod22_) has_solids = lod22_.get_data_vec()[i].has_value();
+      return has_solids;
+    }
+
+    // The BuildingParts of Building i, which has solids, in sid order, because the
+    // MeshMap order is not reproducible. b_id is only for the messages.
+    void parts(size_t i, const std::string& b_id, std::vector<Part>& parts) const {
+      const MeshMap* meshmap12 = meshmap(lod12_, export_lod12_, i);
+      const MeshMap* meshmap13 = meshmap(lod13_, export_lod13_, i);
+      const MeshMap* meshmap22 = meshmap(lod22_, export_lod22_, i);
+
+      auto& sids = part_meshmap(i);
+      parts.resize(sids.size());
+      size_t k = 0;
+      for (auto& [sid, mesh] : sids) {
+        parts[k].sid = sid;
+        parts[k].attribute_index = first_part_[i] + k;
+        ++k;
+      }
+      std::sort(parts.begin(), parts.end(), [](const Part& a, const Part& b) { return a.sid < b.sid; });
+
+      for (auto& part : parts) {
+        part.meshes.clear();
+        part.lods.clear();
+        auto add_lod = [&](const MeshMap* lod_meshmap, const char* lod) {
+          if (!lod_meshmap) return false;
+          auto mesh = lod_meshmap->find(part.sid);
+          if (mesh == lod_meshmap->end()) return false;
+          part.meshes.push_back(&mesh->second);
+          part.lods.push_back(lod);
+          return true;
+        };
+        // skip the rare cases where the sid's between different lod's do not line up (eg for very fragmented buildings from poor dim pointcloud).
+        if (export_lod12_ && !add_lod(meshmap12, "1.2")) {
+          std::cout << "skipping lod 12 building part\n";
+        }
+        if (export_lod13_ && !add_lod(meshmap13, "1.3")) {
+          std::cout << "skipping lod 13 building part\n";
+        }
+        if (export_lod22_ && !add_lod(meshmap22, "2.2")) {
+          throw(gfException("Building " + b_id + " has no LoD 2.2 geometry for part " + std::to_string(part.sid)));
+        }
+      }
+    }
+  };
+
+  // Receives each CityObject as soon as it is complete. The BuildingParts of a
+  // Building come before the Building itself.
+  // The CityObject lives in a JSONArena and is only valid during the call.
+  typedef std::function<void(const std::string& id, ArenaJSON& cityobject)> CityObjectSink;
 
     // Helper functions for processing CityJSON data
   class CityJSON{
 
     public:
-      static std::vector<std::vector<size_t>> LinearRing2jboundary(std::map<arr3d, size_t>& vertex_map, const LinearRing& face, NodeManager& manager);
-      static nlohmann::json::object_t mesh2jSolid(const Mesh& mesh, const char* lod, std::map<arr3d, size_t>& vertex_map, NodeManager& manager);
+      static std::vector<std::vector<size_t>> LinearRing2jboundary(CityJSONVertices& vertices, const LinearRing& face, Box& bbox);
+      static ArenaJSON mesh2jSolid(const Mesh& mesh, const char* lod, CityJSONVertices::Boundaries&& exterior_shell);
+      static void write_indices(TextWriter& out, const std::vector<size_t>& indices);
+      template <typename T> static void write_indices(TextWriter& out, const std::vector<T>& indices);
+      template <typename Label> static void write_solid(TextWriter& out, const char* lod, const CityJSONVertices::Boundaries& exterior_shell, const std::vector<Label>& values);
       static void write_cityobjects(gfSingleFeatureInputTerminal& footprints,
                                     gfSingleFeatureInputTerminal& multisolids_lod12,
                                     gfSingleFeatureInputTerminal& multisolids_lod13,
                                     gfSingleFeatureInputTerminal& multisolids_lod22,
                                     gfMultiFeatureInputTerminal&  attributes,
                                     gfMultiFeatureInputTerminal&  part_attributes,
-                                    json&                         outputJSON,
-                                    std::vector<arr3d>&           vertex_vec,
+                                    const CityObjectSink&         add_cityobject,
+                                    std::vector<QuantizedVertex>& vertex_vec,
+                                    const arr3d&                  translate,
+                                    const arr3d&                  scale,
                                     std::string&                  identifier_attribute,
                                     StrMap&                       output_attribute_names,
                                     bool&                         only_output_renamed,
+                                    int                           n_threads,
+                                    size_t                        dedup_limit,
+                                    CRSTransform&                 transform,
                                     NodeManager&                  node_manager);
-      static void write_to_file(const json& outputJSON, fs::path& fname, bool prettyPrint_);
-      static nlohmann::json::array_t compute_geographical_extent(Box& bbox, NodeManager& manager);
+      static void write_to_file(const json& outputJSON, fs::path& fname, bool prettyPrint_, int precision = -1, const std::vector<std::array<int,3>>* vertices = nullptr);
+      static std::array<double,6> compute_geographical_extent(Box& bbox, NodeManager& manager);
+      static nlohmann::json feature_metadata(const arr3d& translate, const arr3d& scale, NodeManager& manager);
   };
 
-  std::vector<std::vector<size_t>> CityJSON::LinearRing2jboundary(std::map<arr3d, size_t>& vertex_map, const LinearRing& face, NodeManager& manager) {
-    std::vector<std::vector<size_t>> jface;
-    std::vector<size_t> exterior_ring;
-    for (auto &vertex_ : face) {
-      auto vertex = manager.coord_transform_rev(vertex_);
-      exterior_ring.push_back(vertex_map[vertex]);
-    }
-    jface.emplace_back(std::move(exterior_ring));
-    for (auto &iring : face.interior_rings()) {
-      std::vector<size_t> interior_ring;
-      for (auto &vertex_ : iring) {
-        auto vertex = manager.coord_transform_rev(vertex_);
-        interior_ring.push_back(vertex_map[vertex]);
-      }
-      jface.emplace_back(std::move(interior_ring));
-    }
-    return jface;
+  std::vector<std::vector<size_t>> CityJSON::LinearRing2jboundary(CityJSONVertices& vertices, const LinearRing& face, Box& bbox) {
+    return std::move(vertices.add_polygons(&face, &face + 1, bbox)[0]);
   }
 
-  nlohmann::json::object_t CityJSON::mesh2jSolid(const Mesh& mesh, const char* lod, std::map<arr3d, size_t>& vertex_map, NodeManager& manager) {
-    auto geometry = nlohmann::json::object();
+
+  // exterior_shell are the boundaries of the mesh polygons, see CityJSONVertices::add_meshes().
+  // Degenerate polygons, which have an empty boundary, are left out together with their
+  // semantic label. Returns null if no polygon is left.
+  ArenaJSON CityJSON::mesh2jSolid(const Mesh& mesh, const char* lod, CityJSONVertices::Boundaries&& exterior_shell) {
+    auto values = drop_degenerate_surfaces(exterior_shell, mesh.get_labels());
+    if (exterior_shell.empty()) return nullptr;
+
+    auto geometry = ArenaJSON::object();
     geometry["type"] = "Solid";
     geometry["lod"] = lod;
-    std::vector<std::vector<std::vector<size_t>>> exterior_shell;
-
-    for (auto &face : mesh.get_polygons())
-    {
-      exterior_shell.emplace_back( LinearRing2jboundary(vertex_map, face, manager) );
-    }
-    geometry["boundaries"] = {exterior_shell};
+    geometry["boundaries"] = {std::move(exterior_shell)};
 
-    auto surfaces = nlohmann::json::array();
-    surfaces.push_back(nlohmann::json::object({{
+    auto surfaces = ArenaJSON::array();
+    surfaces.push_back(ArenaJSON::object({{
       "type", "GroundSurface"
     }}));
-    surfaces.push_back(nlohmann::json::object({{
+    surfaces.push_back(ArenaJSON::object({{
       "type", "RoofSurface"
     }}));
-    surfaces.push_back(nlohmann::json::object({
+    surfaces.push_back(ArenaJSON::object({
       {
         "type", "WallSurface"
       },
@@ -202,7 +692,7 @@ namespace geoflow::nodes::basic3d
         "on_footprint_edge", true
       }
     }));
-    surfaces.push_back(nlohmann::json::object({
+    surfaces.push_back(ArenaJSON::object({
       {
         "type", "WallSurface"
       },
@@ -212,42 +702,123 @@ namespace geoflow::nodes::basic3d
     }));
     geometry["semantics"] = {
       {"surfaces", surfaces},
-      {"values", {mesh.get_labels()}}
+      {"values", {values}}
     };
     return geometry;
   }
 
-  void CityJSON::write_to_file(const json& outputJSON, fs::path& fname, bool prettyPrint_)
+  // writes (nested vectors of) vertex indices as json arrays
+  void CityJSON::write_indices(TextWriter& out, const std::vector<size_t>& indices) {
+    out << '[';
+    for (size_t k = 0; k < indices.size(); ++k) {
+      if (k) out << ',';
+      out << indices[k];
+    }
+    out << ']';
+  }
+
+  template <typename T> void CityJSON::write_indices(TextWriter& out, const std::vector<T>& indices) {
+    out << '[';
+    for (size_t k = 0; k < indices.size(); ++k) {
+      if (k) out << ',';
+      write_indices(out, indices[k]);
+    }
+    out << ']';
+  }
+
+  // Writes the text of mesh2jSolid(), members in the same order, without building the
+  // json. The degenerate polygons must have been dropped already.
+  template <typename Label> void CityJSON::write_solid(TextWriter& out, const char* lod, const CityJSONVertices::Boundaries& exterior_shell, const std::vector<Label>& values) {
+    out << "{\"boundaries\":[";
+    write_indices(out, exterior_shell);
+    out << "],\"lod\":\"" << lod << "\",\"semantics\":{\"surfaces\":["
+      "{\"type\":\"GroundSurface\"},"
+      "{\"type\":\"RoofSurface\"},"
+      "{\"on_footprint_edge\":true,\"type\":\"WallSurface\"},"
+      "{\"on_footprint_edge\":false,\"type\":\"WallSurface\"}"
+      "],\"values\":[[";
+    for (size_t k = 0; k < values.size(); ++k) {
+      if (k) out << ',';
+      out << values[k];
+    }
+    out << "]]},\"type\":\"Solid\"}";
+  }
+
+  // precision is the number of decimals of float attributes and geographicalExtent, -1
+  // for exact values. If vertices is given it is written as the vertices member.
+  void CityJSON::write_to_file(const json& outputJSON, fs::path& fname, bool prettyPrint_, int precision, const std::vector<std::array<int,3>>* vertices)
   {
     fs::create_directories(fname.parent_path());
-    std::ofstream ofs;
-    ofs.open(fname);
-    // Note that the following line has no effect on the output
-    ofs << std::fixed << std::setprecision(4);
-    try {
-      if (prettyPrint_)
-        ofs << outputJSON.dump(2);
-      else
-        ofs << outputJSON;
-    } catch (const std::exception& e) {
-      throw(gfIOError(e.what()));
+    std::ofstream ofs(fname, std::ios::out | std::ios::binary);
+    if (!ofs.good()) {
+      throw(gfIOError("Could not open " + fname.string() + " for writing"));
+    }
+    TextWriter out(ofs);
+    CityJSONEmitter emitter(out, precision, prettyPrint_ ? 2 : -1);
+    emitter.write(outputJSON, vertices);
+    out.flush();
+    if (!ofs.good()) {
+      throw(gfIOError("Failed writing " + fname.string()));
     }
   }
 
-  // Computes the geographicalExtent array from a geoflow::Box and the data_offset from the NodeManager
-  nlohmann::json::array_t CityJSON::compute_geographical_extent(Box& bbox, NodeManager& manager) {
+  // Computes the geographicalExtent array from a geoflow::Box and the data_offset from the NodeManager.
+  // The float coordinates are converted with shortest_double().
+  std::array<double,6> CityJSON::compute_geographical_extent(Box& bbox, NodeManager& manager) {
     auto minp = bbox.min();
     auto maxp = bbox.max();
     return {
-      minp[0],
-      minp[1],
-      minp[2],
-      maxp[0],
-      maxp[1],
-      maxp[2]
+      shortest_double(minp[0]),
+      shortest_double(minp[1]),
+      shortest_double(minp[2]),
+      shortest_double(maxp[0]),
+      shortest_double(maxp[1]),
+      shortest_double(maxp[2])
+    };
+  }
+
+  // The first object of a CityJSONSeq, with the transform of the CityJSONFeatures that follow
+  nlohmann::json CityJSON::feature_metadata(const arr3d& translate, const arr3d& scale, NodeManager& manager) {
+    nlohmann::json outputJSON;
+
+    outputJSON["type"] = "CityJSON";
+    outputJSON["version"] = "2.0";
+    outputJSON["CityObjects"] = nlohmann::json::object();
+    outputJSON["vertices"] = nlohmann::json::array();
+
+    outputJSON["transform"] = {
+      {"translate", translate},
+      {"scale", scale}
     };
+    outputJSON["metadata"] = {
+      {"referenceSystem", "https://www.opengis.net/def/crs/" +manager.get_rev_crs_id_auth_name()+ "/0/" +manager.get_rev_crs_id_code() }
+    };
+    return outputJSON;
   }
 
+  // The CityObjects of one Building, its BuildingParts first. The boundaries index
+  // the vertices of the Building itself, until they are merged into the output.
+  struct CityJSONBuilding {
+    std::vector<std::pair<std::string, ArenaJSON>> cityobjects;
+    std::vector<QuantizedVertex> vertices;
+  };
+
+  // replaces every vertex index i in boundaries by remap[i]
+  static void remap_indices(ArenaJSON& boundaries, const std::vector<size_t>& remap) {
+    if (boundaries.is_number()) {
+      boundaries = remap[boundaries.get<size_t>()];
+    } else {
+      for (auto& b : boundaries) remap_indices(b, remap);
+    }
+  }
+
+  // The Buildings are built on a thread pool, in chunks, each with its own vertex list.
+  // Every thread has a JSONArena for the Buildings it builds in a chunk, so the arenas
+  // take about one 64 KiB block per thread plus the json of a chunk. The chunks are
+  // merged in Building order into vertex_vec, so the output is the same for any number
+  // of threads. The vertices of all Buildings are deduplicated with one VertexIndex.
+  // Once that holds dedup_limit vertices it is cleared, so that memory stays bounded
+  // at the cost of writing some vertices more than once. 0 means no limit.
   void CityJSON::write_cityobjects(
     gfSingleFeatureInputTerminal& footprints,
     gfSingleFeatureInputTerminal& multisolids_lod12,
@@ -255,188 +826,188 @@ namespace geoflow::nodes::basic3d
     gfSingleFeatureInputTerminal& multisolids_lod22,
     gfMultiFeatureInputTerminal&  attributes,
     gfMultiFeatureInputTerminal&  part_attributes,
-    json&                         outputJSON,
-    std::vector<arr3d>&           vertex_vec,
+    const CityObjectSink&         add_cityobject,
+    std::vector<QuantizedVertex>& vertex_vec,
+    const arr3d&                  translate,
+    const arr3d&                  scale,
     std::string&                  identifier_attribute,
     StrMap&                       output_attribute_names,
     bool&                         only_output_renamed,
+    int                           n_threads,
+    size_t                        dedup_limit,
+    CRSTransform&                 transform,
     NodeManager&                  node_manager)
   {
-    std::map<arr3d, size_t> vertex_map;
-    std::set<arr3d> vertex_set;
-    size_t id_cntr = 0;
-    size_t bp_counter = 0;
-
-    // we expect at least one of the geomtry inputs is set
-    bool export_lod12 = multisolids_lod12.has_data();
-    bool export_lod13 = multisolids_lod13.has_data();
-    bool export_lod22 = multisolids_lod22.has_data();
-    size_t geometry_count = 0;
-    if (export_lod12)
-      geometry_count = multisolids_lod12.size();
-    else if (export_lod13)
-      geometry_count = multisolids_lod13.size();
-    else if (export_lod22)
-      geometry_count = multisolids_lod22.size();
+    CityJSONBuildingInputs inputs(footprints, multisolids_lod12, multisolids_lod13, multisolids_lod22);
+    size_t geometry_count = inputs.size();
 
-    typedef std::unordered_map<int, Mesh> MeshMap;
+    auto attribute_encoders = CityJSONAttributeEncoder::compile(attributes, &output_attribute_names, only_output_renamed);
+    auto id_encoder = CityJSONAttributeEncoder::find_identifier(attribute_encoders, identifier_attribute);
+    auto part_attribute_encoders = CityJSONAttributeEncoder::compile(part_attributes);
 
-    for (size_t i=0; i<geometry_count; ++i) {
-      auto building = nlohmann::json::object();
-      auto b_id = std::to_string(++id_cntr);
+    auto build = [&](size_t i, CityJSONVertices& vertices, CityJSONBuilding& result) {
+      auto building = ArenaJSON::object();
+      auto b_id = std::to_string(i + 1);
       building["type"] = "Building";
 
       // Building atributes
-      bool id_from_attr = false;
-      auto jattributes = nlohmann::json::object();
-      for (auto& term : attributes.sub_terminals()) {
-        auto tname = term->get_full_name();
-
-        //see if we need to rename this attribute
-        auto search = output_attribute_names.find(tname);
-        if(search != output_attribute_names.end()) {
-          //ignore if the new name is an empty string
-          if(search->second.size()!=0)
-            tname = search->second;
-        } else if (only_output_renamed) {
-          continue;
-        }
-
-        if (!term->get_data_vec()[i].has_value()) {
-          nlohmann::json j_null;
-          jattributes[tname] = j_null;
-          continue;
-        }
-
-        if (term->accepts_type(typeid(bool))) {
-          jattributes[tname] = term->get<const bool&>(i);
-        } else if (term->accepts_type(typeid(float))) {
-          jattributes[tname] = term->get<const float&>(i);
-          if (tname == identifier_attribute) {
-            b_id = std::to_string(term->get<const float&>(i));
-          }
-        } else if (term->accepts_type(typeid(int))) {
-          jattributes[tname] = term->get<const int&>(i);
-          if (tname == identifier_attribute) {
-            b_id = std::to_string(term->get<const int&>(i));
-            id_from_attr = true;
-          }
-        } else if (term->accepts_type(typeid(std::string))) {
-          jattributes[tname] = term->get<const std::string&>(i);
-          if (tname == identifier_attribute) {
-            b_id = term->get<const std::string&>(i);
-            id_from_attr = true;
-          }
-        // for date/time we follow https://en.wikipedia.org/wiki/ISO_8601
-        } else if (term->accepts_type(typeid(Date))) {
-          auto t = term->get<const Date&>(i);
-          std::string date = t.format_to_ietf();
-          jattributes[tname] = date;
-        } else if (term->accepts_type(typeid(Time))) {
-          auto t = term->get<const Time&>(i);
-          std::string time = std::to_string(t.hour) + ":" + std::to_string(t.minute) + ":" + std::to_string(t.second) + "Z";
-          jattributes[tname] = time;
-        } else if (term->accepts_type(typeid(DateTime))) {
-          auto t = term->get<const DateTime&>(i);
-          std::string datetime = t.format_to_ietf();
-          jattributes[tname] = datetime;
-        }
+      auto jattributes = ArenaJSON::object();
+      for (auto& encoder : attribute_encoders) {
+        jattributes[encoder.name] = encoder.encode(i);
+      }
+      if (id_encoder && id_encoder->has_value(i)) {
+        b_id = id_encoder->id_string(i);
       }
 
       building["attributes"] = jattributes;
 
       // footprint geometry
-      auto fp_geometry = nlohmann::json::object();
+      auto fp_geometry = ArenaJSON::object();
       fp_geometry["lod"] = "0";
       fp_geometry["type"] = "MultiSurface";
 
-      LinearRing footprint = footprints.get<LinearRing>(i);
-      add_vertices_polygon(vertex_map, vertex_vec, vertex_set, footprint, node_manager);
-      fp_geometry["boundaries"] = {CityJSON::LinearRing2jboundary(vertex_map, footprint, node_manager)};
-      building["geometry"].push_back(fp_geometry);
+      LinearRing footprint = inputs.footprint(i);
+      Box fp_bbox;
+      auto fp_boundary = CityJSON::LinearRing2jboundary(vertices, footprint, fp_bbox);
+      // a degenerate footprint is left out
+      if (!fp_boundary.empty()) {
+        fp_geometry["boundaries"] = {std::move(fp_boundary)};
+        building["geometry"].push_back(fp_geometry);
+      }
 
       std::vector<std::string> buildingPartIds;
 
-
-      bool has_solids = false;
-      if (export_lod12) has_solids = multisolids_lod12.get_data_vec()[i].has_value();
-      if (export_lod13) has_solids = multisolids_lod13.get_data_vec()[i].has_value();
-      if (export_lod22) has_solids = multisolids_lod22.get_data_vec()[i].has_value();
-
       Box building_bbox;
-      if (has_solids) {
-        MeshMap meshmap;
-        if (export_lod22) {
-          meshmap = multisolids_lod22.get<MeshMap>(i);
-        } else if (export_lod13) {
-          meshmap = multisolids_lod13.get<MeshMap>(i);
-        } else if (export_lod12) {
-          meshmap = multisolids_lod12.get<MeshMap>(i);
-        }
-        for ( const auto& [sid, solid_lodx] : meshmap ) {
-          auto buildingPart = nlohmann::json::object();
-          auto bp_id = b_id + "-" + std::to_string(sid);
+      if (inputs.has_solids(i)) {
+        std::vector<CityJSONBuildingInputs::Part> parts;
+        inputs.parts(i, b_id, parts);
+        std::vector<Box> bboxes;
+        for (auto& part : parts) {
+          auto buildingPart = ArenaJSON::object();
+          auto bp_id = b_id + "-" + std::to_string(part.sid);
 
           buildingPartIds.push_back(bp_id);
           buildingPart["type"] = "BuildingPart";
           buildingPart["parents"] = {b_id};
 
-          // Use try-except here for some rare cases when the sid's between different lod's do not line up (eg for very fragmented buildings from poor dim pointcloud).
-          if (export_lod12) {
-            try {
-              building_bbox = add_vertices_mesh(vertex_map, vertex_vec, vertex_set, multisolids_lod12.get<MeshMap>(i).at(sid), node_manager);
-              buildingPart["geometry"].push_back(CityJSON::mesh2jSolid(multisolids_lod12.get<MeshMap>(i).at(sid), "1.2", vertex_map, node_manager));
-            } catch (const std::exception& e) {
-              std::cout << "skipping lod 12 building part\n";
-            }
-          }
-          if (export_lod13) {
-            try {
-              building_bbox = add_vertices_mesh(vertex_map, vertex_vec, vertex_set, multisolids_lod13.get<MeshMap>(i).at(sid), node_manager);
-              buildingPart["geometry"].push_back(CityJSON::mesh2jSolid(multisolids_lod13.get<MeshMap>(i).at(sid), "1.3", vertex_map, node_manager));
-            } catch (const std::exception& e) {
-              std::cout << "skipping lod 13 building part\n";
-            }
-          }
-          if (export_lod22) {
-            building_bbox = add_vertices_mesh(vertex_map, vertex_vec, vertex_set, multisolids_lod22.get<MeshMap>(i).at(sid), node_manager);
-            buildingPart["geometry"].push_back(CityJSON::mesh2jSolid(multisolids_lod22.get<MeshMap>(i).at(sid), "2.2", vertex_map, node_manager));
+          // all LoDs of the part in one transform_rev() call
+          auto shells = vertices.add_meshes(part.meshes, bboxes);
+          for (size_t m = 0; m < part.meshes.size(); ++m) {
+            auto solid = CityJSON::mesh2jSolid(*part.meshes[m], part.lods[m], std::move(shells[m]));
+            if (!solid.is_null()) buildingPart["geometry"].push_back(std::move(solid));
           }
+          if (!part.meshes.empty()) building_bbox = bboxes.back();
 
           //attrubutes
-          auto jattributes = nlohmann::json::object();
-          for (auto& term : part_attributes.sub_terminals()) {
-            auto tname = term->get_full_name();
-            if (!term->get_data_vec()[i].has_value()) {
-              nlohmann::json j_null;
-              jattributes[tname] = j_null;
-              continue;
-            }
-
-            if (term->accepts_type(typeid(bool))) {
-              jattributes[tname] = term->get<const bool&>(bp_counter);
-            } else if (term->accepts_type(typeid(float))) {
-              jattributes[tname] = term->get<const float&>(bp_counter);
-            } else if (term->accepts_type(typeid(int))) {
-              jattributes[tname] = term->get<const int&>(bp_counter);
-            } else if (term->accepts_type(typeid(std::string))) {
-              jattributes[tname] = term->get<const std::string&>(bp_counter);
-            }
+          auto jattributes = ArenaJSON::object();
+          for (auto& encoder : part_attribute_encoders) {
+            jattributes[encoder.name] = encoder.encode(part.attribute_index);
           }
-          ++bp_counter;
           buildingPart["attributes"] = jattributes;
 
-          outputJSON["CityObjects"][bp_id] = buildingPart;
+          result.cityobjects.emplace_back(bp_id, std::move(buildingPart));
         }
       }
 
       building["children"] = buildingPartIds;
       building["geographicalExtent"] = CityJSON::compute_geographical_extent(building_bbox, node_manager);
 
-      outputJSON["CityObjects"][b_id] = building;
+      result.cityobjects.emplace_back(b_id, std::move(building));
+    };
+
+    ThreadPool pool(n_threads);
+    // the vertices of the Building that a thread is working on
+    std::vector<std::vector<QuantizedVertex>> thread_vertex_vecs(pool.size());
+    std::vector<std::unique_ptr<CityJSONVertices>> thread_vertices(pool.size());
+
+    VertexIndex<QuantizedVertex> vertex_index;
+    size_t n_vertices = 0;
+    std::vector<size_t> remap;
+    const size_t chunk_size = 64 * pool.size();
+    // declared before the chunk, so that the Buildings are destroyed first
+    std::vector<JSONArena> arenas(pool.size());
+    std::vector<CityJSONBuilding> chunk;
+    for (size_t i0 = 0; i0 < geometry_count; i0 += chunk_size) {
+      size_t n = std::min(chunk_size, geometry_count - i0);
+      chunk.clear();
+      chunk.resize(n);
+      for (auto& arena : arenas) arena.reset();
+      auto build_in_chunk = [&](size_t k, size_t thread_id) {
+        auto& vertices = thread_vertices[thread_id];
+        if (!vertices) {
+          vertices = std::make_unique<CityJSONVertices>(transform, thread_vertex_vecs[thread_id], translate, scale);
+        }
+        vertices->clear();
+        JSONArenaScope arena_scope(arenas[thread_id]);
+        build(i0 + k, *vertices, chunk[k]);
+        chunk[k].vertices.swap(thread_vertex_vecs[thread_id]);
+      };
+      // The threads do not call the NodeManager otherwise, so only the transform
+      // limits them. Until it is known to skip PROJ, the Buildings are built on this
+      // thread, see CRSTransform. With PROJ that is all of them.
+      size_t k0 = 0;
+      for (; k0 < n && !transform.rev_is_fast(); ++k0) build_in_chunk(k0, 0);
+      pool.parallel_for(n - k0, [&](size_t k, size_t thread_id) { build_in_chunk(k0 + k, thread_id); });
+
+      for (auto& result : chunk) {
+        remap.resize(result.vertices.size());
+        for (size_t v = 0; v < result.vertices.size(); ++v) {
+          if (dedup_limit && vertex_index.size() == dedup_limit) vertex_index.clear();
+          auto [v_idx, did_insert] = vertex_index.insert(result.vertices[v], n_vertices);
+          if (did_insert) {
+            vertex_vec.push_back(result.vertices[v]);
+            ++n_vertices;
+          }
+          remap[v] = v_idx;
+        }
+        for (auto& [id, cityobject] : result.cityobjects) {
+          auto geometry = cityobject.find("geometry");
+          if (geometry != cityobject.end()) {
+            for (auto& g : *geometry) remap_indices(g["boundaries"], remap);
+          }
+          add_cityobject(id, cityobject);
+        }
+      }
     }
   }
 
+  nlohmann::json CityJSONWriterNode::make_metadata(Box& bbox) {
+    auto metadata = nlohmann::json::object();
+    metadata["geographicalExtent"] = CityJSON::compute_geographical_extent(bbox, manager);
+
+    metadata["identifier"] = manager.substitute_globals(meta_identifier_);
+
+    // metadata.datasetPointOfContact - only add it if at least one of the parameters is filled
+    auto contact = nlohmann::json::object();
+
+    if (std::string val = manager.substitute_globals(meta_poc_contactName_); !val.empty()) { contact["contactName"] = val; }
+    if (std::string val = manager.substitute_globals(meta_poc_email_); !val.empty()) { contact["emailAddress"] = val; }
+    if (std::string val = manager.substitute_globals(meta_poc_phone_); !val.empty()) { contact["phone"] = val; }
+    // if (std::string val = manager.substitute_globals(meta_poc_address_); !val.empty()) { contact["address"] = val; }
+    if (std::string val = manager.substitute_globals(meta_poc_type_); !val.empty()) { contact["contactType"] = val; }
+    if (std::string val = manager.substitute_globals(meta_poc_website_); !val.empty()) { contact["website"] = val; }
+
+    metadata["pointOfContact"] = contact;
+
+    if (std::string val = manager.substitute_globals(meta_referenceDate_); !val.empty()) {
+      // find current date if none provided
+      auto t = std::time(nullptr);
+      auto tm = *std::localtime(&t);
+      std::ostringstream oss;
+      oss << std::put_time(&tm, "%Y-%m-%d");
+      meta_referenceDate_              = oss.str();
+    }
+    metadata["referenceDate"] = manager.substitute_globals(meta_referenceDate_);
+
+    metadata["referenceSystem"] = manager.substitute_globals(meta_referenceSystem_);
+    if(manager.has_process_crs()) {
+      metadata["referenceSystem"] = "https://www.opengis.net/def/crs/" +manager.get_rev_crs_id_auth_name()+ "/0/" +manager.get_rev_crs_id_code();
+    }
+
+    metadata["title"] = manager.substitute_globals(meta_title_);
+    return metadata;
+  }
+
   void CityJSONWriterNode::process() {
     // inputs
     auto& footprints = vector_input("footprints");
@@ -448,8 +1019,20 @@ namespace geoflow::nodes::basic3d
     std::string identifier_attribute =
       manager.substitute_globals(identifier_attribute_);
 
-    auto CRS = manager.substitute_globals(CRS_).c_str();
-    manager.set_rev_crs_transform(CRS);
+    auto CRS = manager.substitute_globals(CRS_);
+    manager.set_rev_crs_transform(CRS.c_str());
+    crs_transform_.start_run(CRS);
+
+    fs::path fname = fs::path(manager.substitute_globals(filepath_));
+    if (streaming_) {
+      if (prettyPrint_) {
+        std::cout << "CityJSONWriter: prettyPrint is ignored in streaming mode\n";
+      }
+      write_streaming(fname);
+      crs_transform_.report("CityJSONWriter");
+      manager.clear_rev_crs_transform();
+      return;
+    }
 
     nlohmann::json outputJSON;
 
@@ -457,81 +1040,124 @@ namespace geoflow::nodes::basic3d
     outputJSON["version"] = "2.0";
     outputJSON["CityObjects"] = nlohmann::json::object();
 
-    std::vector<arr3d> vertex_vec;
+    std::vector<QuantizedVertex> vertex_vec;
+    auto& cityobjects = outputJSON["CityObjects"];
     CityJSON::write_cityobjects(footprints,
                                 multisolids_lod12,
                                 multisolids_lod13,
                                 multisolids_lod22,
                                 attributes,
                                 part_attributes,
-                                outputJSON,
+                                [&](const std::string& id, ArenaJSON& cityobject) {
+                                  cityobjects[id] = cityobject;
+                                },
                                 vertex_vec,
+                                cityjson_mm_translate,
+                                cityjson_mm_scale,
                                 identifier_attribute,
                                 output_attribute_names,
                                 only_output_renamed_,
+                                n_threads_,
+                                0,
+                                crs_transform_,
                                 manager);
 
     Box bbox;
 
     std::vector<std::array<int,3>>vertices_int;
     for (auto& vertex : vertex_vec) {
-      bbox.add(vertex);
+      bbox.add(cityjson_mm_to_meters(vertex));
     }
 
-    auto center = bbox.center();
+    auto center = cityjson_mm_center(bbox);
+    vertices_int.reserve(vertex_vec.size());
     for (auto& vertex : vertex_vec) {
       vertices_int.push_back({
-        int( (vertex[0] - center[0]) * 1000 ),
-        int( (vertex[1] - center[1]) * 1000 ),
-        int( (vertex[2] - center[2]) * 1000 )
+        int( vertex[0] - center[0] ),
+        int( vertex[1] - center[1] ),
+        int( vertex[2] - center[2] )
       });
     }
-    outputJSON["vertices"] = vertices_int;
     outputJSON["transform"] = {
-      {"translate", center},
-      {"scale", {0.001, 0.001, 0.001}}
+      {"translate", cityjson_mm_to_meters(center)},
+      {"scale", cityjson_mm_scale}
     };
 
     // metadata
-    auto metadata = nlohmann::json::object();
-    metadata["geographicalExtent"] = CityJSON::compute_geographical_extent(bbox, manager);
-
-    metadata["identifier"] = manager.substitute_globals(meta_identifier_);
-
-    // metadata.datasetPointOfContact - only add it if at least one of the parameters is filled
-    auto contact = nlohmann::json::object();
-
-    if (std::string val = manager.substitute_globals(meta_poc_contactName_); !val.empty()) { contact["contactName"] = val; }
-    if (std::string val = manager.substitute_globals(meta_poc_email_); !val.empty()) { contact["emailAddress"] = val; }
-    if (std::string val = manager.substitute_globals(meta_poc_phone_); !val.empty()) { contact["phone"] = val; }
-    // if (std::string val = manager.substitute_globals(meta_poc_address_); !val.empty()) { contact["address"] = val; }
-    if (std::string val = manager.substitute_globals(meta_poc_type_); !val.empty()) { contact["contactType"] = val; }
-    if (std::string val = manager.substitute_globals(meta_poc_website_); !val.empty()) { contact["website"] = val; }
-
-    metadata["pointOfContact"] = contact;
+    outputJSON["metadata"] = make_metadata(bbox);
 
-    if (std::string val = manager.substitute_globals(meta_referenceDate_); !val.empty()) {
-      // find current date if none provided
-      auto t = std::time(nullptr);
-      auto tm = *std::localtime(&t);
-      std::ostringstream oss;
-      oss << std::put_time(&tm, "%Y-%m-%d");
-      meta_referenceDate_              = oss.str();
-    }
-    metadata["referenceDate"] = manager.substitute_globals(meta_referenceDate_);
+    CityJSON::write_to_file(outputJSON, fname, prettyPrint_, precision_, &vertices_int);
+    crs_transform_.report("CityJSONWriter");
+    manager.clear_rev_crs_transform();
+  }
 
-    metadata["referenceSystem"] = manager.substitute_globals(meta_referenceSystem_);
-    if(manager.has_process_crs()) {
-      metadata["referenceSystem"] = "https://www.opengis.net/def/crs/" +manager.get_rev_crs_id_auth_name()+ "/0/" +manager.get_rev_crs_id_code();
-    }
+  // Writes the CityObjects to the file as soon as they are complete, instead of
+  // building the whole document in memory first. The vertices are spooled to a
+  // temporary file next to the output, because their transform is only known once
+  // all vertices are in. They are appended to the output at the end, followed by the
+  // transform and the metadata. The output is not pretty printed. A CityObject can
+  // not be overwritten once it is written, so duplicate ids are an error.
+  // Memory use does not grow with the vertices of the tile: the vertices are only
+  // deduplicated within the last streaming_dedup_limit of them, which takes a
+  // VertexIndex of at most 2^20 slots of 40 bytes. It does grow with the CityObjects,
+  // as their ids are kept to find duplicates.
+  void CityJSONWriterNode::write_streaming(fs::path& fname) {
+    constexpr size_t streaming_dedup_limit = size_t(1) << 19;
+    std::string identifier_attribute =
+      manager.substitute_globals(identifier_attribute_);
 
-    metadata["title"] = manager.substitute_globals(meta_title_);
+    CityJSONStream stream(fname, precision_);
+    auto& out = stream.out;
+    out << "{\"type\":\"CityJSON\",\"version\":\"2.0\",\"CityObjects\":{";
 
-    outputJSON["metadata"] = metadata;
+    Box bbox;
+    std::vector<QuantizedVertex> vertex_vec;
+    CityJSON::write_cityobjects(vector_input("footprints"),
+                                vector_input("geometry_lod12"),
+                                vector_input("geometry_lod13"),
+                                vector_input("geometry_lod22"),
+                                poly_input("attributes"),
+                                poly_input("part_attributes"),
+                                [&](const std::string& id, ArenaJSON& cityobject) {
+                                  stream.add_cityobject(id, cityobject);
+                                  // spool the vertices that were added for this CityObject
+                                  for (auto& vertex : vertex_vec) {
+                                    bbox.add(cityjson_mm_to_meters(vertex));
+                                  }
+                                  stream.add_vertices(vertex_vec);
+                                  vertex_vec.clear();
+                                },
+                                vertex_vec,
+                                cityjson_mm_translate,
+                                cityjson_mm_scale,
+                                identifier_attribute,
+                                output_attribute_names,
+                                only_output_renamed_,
+                                n_threads_,
+                                streaming_dedup_limit,
+                                crs_transform_,
+                                manager);
 
-    fs::path fname = fs::path(manager.substitute_globals(filepath_));
-    CityJSON::write_to_file(outputJSON, fname, prettyPrint_);
-    manager.clear_rev_crs_transform();
+    out << "},\"vertices\":[";
+    auto center = cityjson_mm_center(bbox);
+    stream.write_vertices([&](const QuantizedVertex& vertex) {
+      return std::array<int,3>{
+        int( vertex[0] - center[0] ),
+        int( vertex[1] - center[1] ),
+        int( vertex[2] - center[2] )
+      };
+    });
+
+    nlohmann::json transform = {
+      {"translate", cityjson_mm_to_meters(center)},
+      {"scale", cityjson_mm_scale}
+    };
+    out << "],\"transform\":";
+    stream.emitter.write_exact(transform);
+    out << ",\"metadata\":";
+    stream.emitter.write(make_metadata(bbox));
+    out << '}';
+    stream.close();
   }
 
   void CityJSONFeatureWriterNode::process() {
@@ -545,74 +1171,176 @@ namespace geoflow::nodes::basic3d
     std::string identifier_attribute =
       manager.substitute_globals(identifier_attribute_);
 
-    manager.set_rev_crs_transform(manager.substitute_globals(CRS_).c_str());
+    auto CRS = manager.substitute_globals(CRS_);
+    manager.set_rev_crs_transform(CRS.c_str());
+    crs_transform_.start_run(CRS);
+
+    CityJSONBuildingInputs inputs(footprints, multisolids_lod12, multisolids_lod13, multisolids_lod22);
+    auto attribute_encoders = CityJSONAttributeEncoder::compile(attributes, &output_attribute_names, only_output_renamed_);
+    auto id_encoder = CityJSONAttributeEncoder::find_identifier(attribute_encoders, identifier_attribute);
+    auto part_attribute_encoders = CityJSONAttributeEncoder::compile(part_attributes);
+    auto attribute_members = CityJSONAttributeEncoder::members(attribute_encoders);
+    auto part_attribute_members = CityJSONAttributeEncoder::members(part_attribute_encoders);
+
+    // The feature is written straight to feature_text_, in the same layout as the
+    // CityObjects of write_cityobjects(), without building a document. The vertices
+    // come out quantized with the transform of the CityJSONFeatureMetadataWriter.
+    auto& out = feature_text_;
+    out.clear();
+    CityJSONEmitter emitter(out, precision_);
+    out << "{\"type\":\"CityJSONFeature\",\"CityObjects\":{";
+
+    std::vector<QuantizedVertex> vertex_vec;
+    CityJSONVertices vertices(crs_transform_, vertex_vec, {translate_x_, translate_y_, translate_z_}, {scale_x_, scale_y_, scale_z_});
+    std::string feature_id;
+    bool first = true;
+    auto write_key = [&](const std::string& id) {
+      if (!first) out << ',';
+      first = false;
+      emitter.write_string(id);
+      out << ':';
+    };
 
-    nlohmann::json outputJSON;
+    std::vector<CityJSONBuildingInputs::Part> parts;
+    std::vector<Box> bboxes;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      auto b_id = std::to_string(i + 1);
+      if (id_encoder && id_encoder->has_value(i)) {
+        b_id = id_encoder->id_string(i);
+      }
 
-    outputJSON["type"] = "CityJSONFeature";
-    outputJSON["CityObjects"] = nlohmann::json::object();
+      // the footprint comes first, to number the vertices like write_cityobjects()
+      LinearRing footprint = inputs.footprint(i);
+      Box fp_bbox;
+      auto fp_boundary = CityJSON::LinearRing2jboundary(vertices, footprint, fp_bbox);
 
-    std::vector<arr3d> vertex_vec;
-    CityJSON::write_cityobjects(footprints,
-                                multisolids_lod12,
-                                multisolids_lod13,
-                                multisolids_lod22,
-                                attributes,
-                                part_attributes,
-                                outputJSON,
-                                vertex_vec,
-                                identifier_attribute,
-                                output_attribute_names,
-                                only_output_renamed_,
-                                manager);
+      std::vector<std::string> buildingPartIds;
+      Box building_bbox;
+      if (inputs.has_solids(i)) {
+        inputs.parts(i, b_id, parts);
+        for (auto& part : parts) {
+          auto bp_id = b_id + "-" + std::to_string(part.sid);
+          buildingPartIds.push_back(bp_id);
 
-    // The main Building is the parent object.
-    // Bit of a hack. Ideally we would know exactly which ID we set,
-    // instead of just iterating. But it is assumed that in case of writing to
-    // CityJSONFeature there is only one parent CityObject.
-    for (auto& el : outputJSON["CityObjects"].items()) {
-      if (!el.value().contains(std::string("parents"))) {
-        outputJSON["id"] = el.key();
+          write_key(bp_id);
+          out << "{\"attributes\":";
+          CityJSONAttributeEncoder::write_object(part_attribute_members, emitter, out, part.attribute_index);
+          // all LoDs of the part in one transform_rev() call
+          auto shells = vertices.add_meshes(part.meshes, bboxes);
+          bool has_geometry = false;
+          for (size_t m = 0; m < part.meshes.size(); ++m) {
+            auto values = drop_degenerate_surfaces(shells[m], part.meshes[m]->get_labels());
+            if (shells[m].empty()) continue;
+            out << (has_geometry ? "," : ",\"geometry\":[");
+            has_geometry = true;
+            CityJSON::write_solid(out, part.lods[m], shells[m], values);
+          }
+          if (has_geometry) out << ']';
+          if (!part.meshes.empty()) building_bbox = bboxes.back();
+          out << ",\"parents\":[";
+          emitter.write_string(b_id);
+          out << "],\"type\":\"BuildingPart\"}";
+        }
       }
-    };
 
-    std::vector<std::array<int,3>>vertices_int;
-    double _offset_x = translate_x_;
-    double _offset_y = translate_y_;
-    double _offset_z = translate_z_;
-    for (auto& vertex : vertex_vec) {
-      vertices_int.push_back({
-        int( (vertex[0] - _offset_x ) / scale_x_ ),
-        int( (vertex[1] - _offset_y ) / scale_y_ ),
-        int( (vertex[2] - _offset_z ) / scale_z_ )
-      });
+      // The main Building is the parent object. It is assumed that in case of writing
+      // to CityJSONFeature there is only one.
+      feature_id = b_id;
+      write_key(b_id);
+      out << "{\"attributes\":";
+      CityJSONAttributeEncoder::write_object(attribute_members, emitter, out, i);
+      out << ",\"children\":[";
+      for (size_t k = 0; k < buildingPartIds.size(); ++k) {
+        if (k) out << ',';
+        emitter.write_string(buildingPartIds[k]);
+      }
+      out << "],\"geographicalExtent\":[";
+      auto extent = CityJSON::compute_geographical_extent(building_bbox, manager);
+      for (size_t k = 0; k < extent.size(); ++k) {
+        if (k) out << ',';
+        emitter.write_float(extent[k]);
+      }
+      out << ']';
+      // a degenerate footprint is left out
+      if (!fp_boundary.empty()) {
+        out << ",\"geometry\":[{\"boundaries\":[";
+        CityJSON::write_indices(out, fp_boundary);
+        out << "],\"lod\":\"0\",\"type\":\"MultiSurface\"}]";
+      }
+      out << ",\"type\":\"Building\"}";
+    }
+
+    out << '}';
+    if (!feature_id.empty()) {
+      out << ",\"id\":";
+      emitter.write_string(feature_id);
     }
-    outputJSON["vertices"] = vertices_int;
+    out << ",\"vertices\":";
+    emitter.write_vertices(vertex_vec);
+    out << '}';
 
     fs::path fname = fs::path(manager.substitute_globals(filepath_));
-    CityJSON::write_to_file(outputJSON, fname, prettyPrint_);
+    if (sequence_) {
+      write_sequence(fname.string(), out.view());
+    } else if (prettyPrint_) {
+      // pretty printing is for inspection, it is fine to go through a document
+      CityJSON::write_to_file(nlohmann::json::parse(out.view()), fname, true, precision_);
+    } else {
+      fs::create_directories(fname.parent_path());
+      std::ofstream ofs(fname, std::ios::out | std::ios::binary);
+      if (!ofs.good()) {
+        throw(gfIOError("Could not open " + fname.string() + " for writing"));
+      }
+      ofs.write(out.view().data(), out.view().size());
+      if (!ofs.good()) {
+        throw(gfIOError("Failed writing " + fname.string()));
+      }
+    }
+    crs_transform_.report("CityJSONFeatureWriter");
     manager.clear_rev_crs_transform();
   }
 
+  // Appends the feature as one line to the CityJSONSeq file. The file stays open
+  // between runs and is flushed at the end of every run, like the PLY append mode,
+  // so that the file on disk only holds complete lines in between.
+  void CityJSONFeatureWriterNode::write_sequence(const std::string& fname, std::string_view feature) {
+    // start a new file if the path changed
+    if (!seq_ofs_.is_open() || fname != seq_fname_) {
+      seq_out_.reset();
+      if (seq_ofs_.is_open()) seq_ofs_.close();
+      fs::create_directories(fs::path(fname).parent_path());
+      seq_ofs_.open(fname, std::ios::out | std::ios::binary | std::ios::trunc);
+      if (!seq_ofs_.good()) {
+        throw(gfIOError("Could not open " + fname + " for writing"));
+      }
+      seq_fname_ = fname;
+      seq_out_.emplace(seq_ofs_);
+      CityJSONEmitter(*seq_out_).write(CityJSON::feature_metadata(
+        {translate_x_, translate_y_, translate_z_},
+        {scale_x_, scale_y_, scale_z_},
+        manager
+      ));
+      *seq_out_ << '\n';
+    }
 
-  void CityJSONFeatureMetadataWriterNode::process() {
+    *seq_out_ << feature << '\n';
+    seq_out_->flush();
+    seq_ofs_.flush();
+    if (!seq_ofs_.good()) {
+      throw(gfIOError("Failed writing " + fname));
+    }
+  }
 
-    manager.set_rev_crs_transform(manager.substitute_globals(CRS_).c_str());
 
-    nlohmann::json outputJSON;
+  void CityJSONFeatureMetadataWriterNode::process() {
 
-    outputJSON["type"] = "CityJSON";
-    outputJSON["version"] = "2.0";
-    outputJSON["CityObjects"] = nlohmann::json::object();
-    outputJSON["vertices"] = nlohmann::json::array();
+    manager.set_rev_crs_transform(manager.substitute_globals(CRS_).c_str());
 
-    outputJSON["transform"] = {
-      {"translate", { translate_x_, translate_y_, translate_z_ }},
-      {"scale", { scale_x_, scale_y_, scale_z_}}
-    };
-    outputJSON["metadata"] = {
-      {"referenceSystem", "https://www.opengis.net/def/crs/" +manager.get_rev_crs_id_auth_name()+ "/0/" +manager.get_rev_crs_id_code() }
-    };
+    auto outputJSON = CityJSON::feature_metadata(
+      {translate_x_, translate_y_, translate_z_},
+      {scale_x_, scale_y_, scale_z_},
+      manager
+    );
 
     fs::path fname = fs::path(manager.substitute_globals(filepath_));
     CityJSON::write_to_file(outputJSON, fname, prettyPrint_);
@@ -632,16 +1360,16 @@ namespace geoflow::nodes::basic3d
     vector_output("json").push_back(json);
   }
 
-  void offset_indices(nlohmann::json& j, const size_t& offset){
+  template <typename Json> void offset_indices(Json& j, const size_t& offset){
     if (j.type() == nlohmann::json::value_t::number_unsigned) {
-      j = j.get<size_t>() + offset;
+      j = j.template get<size_t>() + offset;
     } else {
       for (auto& k : j) {
         offset_indices(k, offset);
       }
     }
   }
-  void set_vertex_index_offset(nlohmann::json& geometry, const size_t& offset) {
+  template <typename Json> void set_vertex_index_offset(Json& geometry, const size_t& offset) {
     // std::cout<<offset<< std::endl;
 
     // std::cout<<geometry<< std::endl;
@@ -650,97 +1378,162 @@ namespace geoflow::nodes::basic3d
     // std::cout<<geometry<< std::endl;
   }
 
-  void CityJSONLinesWriterNode::process() {
-    auto jsonstr = input("first_line").get<std::string>();
-    nlohmann::json metajson;
+  ArenaJSON parse_cityjson_feature(const std::string& featurestr) {
+    ArenaJSON feature;
     try {
-      metajson = nlohmann::json::parse(jsonstr);
+      feature = ArenaJSON::parse(featurestr);
     } catch (const std::exception& e) {
       throw(gfIOError(e.what()));
     }
-    auto& features_inp = vector_input("features");
+    if(feature["type"] != "CityJSONFeature") {
+      throw(gfException("input is not CityJSONFeature"));
+    }
+    return feature;
+  }
 
-    size_t vindex_offset = 0;
-    for (size_t i=0; i< features_inp.size(); ++i) {
-      // std::cout<< "FI:" << i<< std::endl;
-      auto& featurestr = features_inp.get<std::string>(i);
-      if (featurestr.size()==0) {
-        std::cout << "empty feature string for feature; skipping...\n";
-        continue;
+  // Adds b3_kwaliteitsindicator to the Buildings of a CityJSONFeature and, with optimal_lod,
+  // keeps only the geometries of the BuildingParts in the optimal lod of their parent.
+  void preprocess_cityjson_feature(ArenaJSON& feature, bool optimal_lod) {
+    auto& cityobjects = feature["CityObjects"];
+    for( auto [id, cobject] : cityobjects.items() ) {
+      // std::cout<< "CID:" << id << std::endl;
+      // std::cout<< "vertex_count:" << cobject[]<< std::endl;
+
+      if (cobject["type"] == "Building") {
+          if (
+             cobject["attributes"].contains("b3_bag_bag_overlap") &&
+             cobject["attributes"].contains("b3_val3dity_lod22") &&
+             cobject["attributes"].contains("b3_pw_selectie_reden")
+             ) {
+              float b3_bag_bag_overlap = 0;
+              if (cobject["attributes"]["b3_bag_bag_overlap"].is_number()) {
+                  b3_bag_bag_overlap = cobject["attributes"].value("b3_bag_bag_overlap", 0);
+              }
+              // b3_val3dity_lod22 can be null
+              auto jval_val3dity = cobject["attributes"].at("b3_val3dity_lod22");
+              auto b3_val3dity_lod22_any = std::any();
+              if (jval_val3dity.is_string())
+              {
+                b3_val3dity_lod22_any = jval_val3dity.template get<std::string>();
+              }
+              // b3_pw_selectie_reden can be null
+              auto jval_pw_selectie = cobject["attributes"].at("b3_pw_selectie_reden");
+              auto b3_pw_selectie_reden_any = std::any();
+              if (jval_pw_selectie.is_string())
+              {
+                b3_pw_selectie_reden_any = jval_pw_selectie.template get<std::string>();
+              }
+              bool val = calculate_kwaliteitsindicator(b3_bag_bag_overlap, b3_val3dity_lod22_any, b3_pw_selectie_reden_any);
+              cobject["attributes"]["b3_kwaliteitsindicator"] = val;
+             }
       }
-      // std::cout<< featurestr << std::endl;
-      nlohmann::json feature;
-      try {
-        feature = nlohmann::json::parse(featurestr);
-      } catch (const std::exception& e) {
-        throw(gfIOError(e.what()));
+    }
+    if(optimal_lod) {
+      for( auto& item : cityobjects.items() ) {
+        auto& cobject = item.value();
+        if(cobject["type"] == "BuildingPart") {
+          auto& ref = cobject["parents"][0];
+          // at(), inserting a missing parent would invalidate cobject
+          std::string optilod = cityobjects.at( ref.get<std::string>() ) ["attributes"]["optimal_lod"];
+          ArenaJSON new_geometries = ArenaJSON::array();
+          for(auto& geom : cobject["geometry"]) {
+            if (geom["lod"] == optilod) {
+              new_geometries.push_back(std::move(geom));
+            }
+          }
+          cobject["geometry"] = std::move(new_geometries);
+        }
       }
+    }
+  }
 
-      if(feature["type"] != "CityJSONFeature") {
-        throw(gfException("input is not CityJSONFeature"));
+  // offsets the boundaries with the number of vertices that precede the feature
+  void offset_cityjson_feature(ArenaJSON& feature, size_t vindex_offset) {
+    for( auto& item : feature["CityObjects"].items() ) {
+      //fix vertex indices...
+      for (auto& geom : item.value()["geometry"]) {
+        set_vertex_index_offset(geom, vindex_offset);
+        // std::cout<<boundaries<< std::endl;
       }
+    }
+  }
 
-      for( auto [id, cobject] : feature["CityObjects"].items() ) {
-        // std::cout<< "CID:" << id << std::endl;
-        // std::cout<< "vertex_count:" << cobject[]<< std::endl;
+  // Parses and pre-processes the CityJSONFeatures on a thread pool, in chunks. Every
+  // thread has a JSONArena for the features it parses in a chunk, which takes about one
+  // 64 KiB block per thread plus the json of a chunk. The vertex offsets follow from the
+  // vertex counts of the features in input order and sink(feature) is called in that
+  // same order, so the output does not depend on the number of threads. Empty features
+  // are skipped.
+  template <typename Sink> void for_each_cityjson_feature(gfSingleFeatureInputTerminal& features_inp, bool optimal_lod, size_t vindex_offset, int n_threads, Sink&& sink) {
+    ThreadPool pool(n_threads);
+    const size_t chunk_size = 64 * pool.size();
+    // declared before the chunk, so that the features are destroyed first
+    std::vector<JSONArena> arenas(pool.size());
+    std::vector<ArenaJSON> chunk;
+    std::vector<size_t> offsets;
+    for (size_t i0 = 0; i0 < features_inp.size(); i0 += chunk_size) {
+      size_t n = std::min(chunk_size, features_inp.size() - i0);
+      chunk.clear();
+      chunk.resize(n);
+      for (auto& arena : arenas) arena.reset();
+      // an empty feature string stays null
+      pool.parallel_for(n, [&](size_t k, size_t thread_id) {
+        auto& featurestr = features_inp.get<std::string>(i0 + k);
+        if (featurestr.size()==0) return;
+        JSONArenaScope arena_scope(arenas[thread_id]);
+        chunk[k] = parse_cityjson_feature(featurestr);
+        preprocess_cityjson_feature(chunk[k], optimal_lod);
+      });
 
-        if (cobject["type"] == "Building") {
-            if (
-               cobject["attributes"].contains("b3_bag_bag_overlap") &&
-               cobject["attributes"].contains("b3_val3dity_lod22") &&
-               cobject["attributes"].contains("b3_pw_selectie_reden")
-               ) {
-                float b3_bag_bag_overlap = 0;
-                if (cobject["attributes"]["b3_bag_bag_overlap"].is_number()) {
-                    b3_bag_bag_overlap = cobject["attributes"].value("b3_bag_bag_overlap", 0);
-                }
-                // b3_val3dity_lod22 can be null
-                auto jval_val3dity = cobject["attributes"].at("b3_val3dity_lod22");
-                auto b3_val3dity_lod22_any = std::any();
-                if (jval_val3dity.is_string())
-                {
-                  b3_val3dity_lod22_any = jval_val3dity.get<std::string>();
-                }
-                // b3_pw_selectie_reden can be null
-                auto jval_pw_selectie = cobject["attributes"].at("b3_pw_selectie_reden");
-                auto b3_pw_selectie_reden_any = std::any();
-                if (jval_pw_selectie.is_string())
-                {
-                  b3_pw_selectie_reden_any = jval_pw_selectie.get<std::string>();
-                }
-                bool val = calculate_kwaliteitsindicator(b3_bag_bag_overlap, b3_val3dity_lod22_any, b3_pw_selectie_reden_any);
-                cobject["attributes"]["b3_kwaliteitsindicator"] = val;
-               }
-        }
+      offsets.resize(n);
+      for (size_t k = 0; k < n; ++k) {
+        offsets[k] = vindex_offset;
+        auto vertices = chunk[k].find("vertices");
+        if (vertices != chunk[k].end()) vindex_offset += vertices->size();
+      }
+      pool.parallel_for(n, [&](size_t k, size_t thread_id) {
+        if (chunk[k].is_null()) return;
+        JSONArenaScope arena_scope(arenas[thread_id]);
+        offset_cityjson_feature(chunk[k], offsets[k]);
+      });
 
-        metajson["CityObjects"][id] = cobject;
-        //fix vertex indices...
-        for (auto& geom : metajson["CityObjects"][id]["geometry"]) {
-          set_vertex_index_offset(geom, vindex_offset);
-          // std::cout<<boundaries<< std::endl;
+      for (auto& feature : chunk) {
+        if (feature.is_null()) {
+          std::cout << "empty feature string for feature; skipping...\n";
+          continue;
         }
+        sink(feature);
       }
-      if(optimal_lod_) {
-        for( auto& item : feature["CityObjects"].items() ) {
-          auto& cobject = metajson["CityObjects"][item.key()];
-          if(cobject["type"] == "BuildingPart") {
-            auto& ref = cobject["parents"][0];
-            std::string optilod = feature["CityObjects"][ ref ] ["attributes"]["optimal_lod"];
-            std::vector<nlohmann::json> new_geometries;
-            for(auto& geom : cobject["geometry"]) {
-              if (geom["lod"] == optilod) {
-                new_geometries.push_back(geom);
-              }
-            }
-            cobject["geometry"] = new_geometries;
-          }
-        }
+    }
+  }
+
+  void CityJSONLinesWriterNode::process() {
+    auto jsonstr = input("first_line").get<std::string>();
+    nlohmann::json metajson;
+    try {
+      metajson = nlohmann::json::parse(jsonstr);
+    } catch (const std::exception& e) {
+      throw(gfIOError(e.what()));
+    }
+    fs::path fname = fs::path(manager.substitute_globals(filepath_));
+    if (streaming_) {
+      if (prettyPrint_) {
+        std::cout << "CityJSONLinesWriter: prettyPrint is ignored in streaming mode\n";
       }
-      // std::cout << json << std::endl;
-      metajson["vertices"].insert(metajson["vertices"].end(), feature["vertices"].begin(), feature["vertices"].end());
-      // std::cout << json["vertices"] << std::endl;
-      vindex_offset = metajson["vertices"].size();
+      write_streaming(fname, metajson);
+      return;
     }
+    // the features go after the vertices of the first line, if it has any
+    size_t vindex_offset = metajson.contains("vertices") ? metajson["vertices"].size() : 0;
+    for_each_cityjson_feature(vector_input("features"), optimal_lod_, vindex_offset, n_threads_, [&](ArenaJSON& feature) {
+      for( auto& item : feature["CityObjects"].items() ) {
+        metajson["CityObjects"][item.key()] = item.value();
+      }
+      // std::cout << json << std::endl;
+      for (auto& vertex : feature["vertices"]) {
+        metajson["vertices"].push_back(nlohmann::json(vertex));
+      }
+    });
 
     // metadata
     auto& s = metajson["transform"]["scale"];
@@ -777,8 +1570,96 @@ namespace geoflow::nodes::basic3d
     }
     metajson["metadata"]["geographicalExtent"] = CityJSON::compute_geographical_extent(bbox, manager);
 
-    fs::path fname = fs::path(manager.substitute_globals(filepath_));
-    CityJSON::write_to_file(metajson, fname, prettyPrint_);
+    CityJSON::write_to_file(metajson, fname, prettyPrint_, precision_);
+  }
+
+  // Writes the CityObjects of each feature to the file as soon as it is parsed, so that
+  // only one feature is in memory at a time instead of the whole tile. The vertices are
+  // spooled to a temporary file next to the output and appended at the end, followed
+  // by the transform and the metadata. The output is not pretty printed. Unlike the
+  // in-memory mode, a CityObject id that occurs twice is an error instead of the later
+  // one replacing the first.
+  void CityJSONLinesWriterNode::write_streaming(fs::path& fname, nlohmann::json& metajson) {
+    if (!metajson.contains("transform")) {
+      throw(gfIOError("first_line has no transform"));
+    }
+    CityJSONStream stream(fname, precision_);
+    auto& out = stream.out;
+    // the members of the first line, the CityObjects and vertices it may have are merged with those of the features
+    out << '{';
+    for (auto& item : metajson.items()) {
+      if (item.key() == "CityObjects" || item.key() == "vertices" || item.key() == "transform" || item.key() == "metadata") continue;
+      stream.emitter.write_string(item.key());
+      out << ':';
+      stream.emitter.write(item.value());
+      out << ',';
+    }
+    out << "\"CityObjects\":{";
+
+    auto& s = metajson["transform"]["scale"];
+    auto& t = metajson["transform"]["translate"];
+    arr3f scale = {s[0].get<float>(), s[1].get<float>(), s[2].get<float>()};
+    Box bbox;
+    std::vector<QuantizedVertex> vertex_vec;
+    auto write_feature = [&](auto& feature) {
+      auto cityobjects = feature.find("CityObjects");
+      if (cityobjects != feature.end()) {
+        for (auto& item : cityobjects->items()) stream.add_cityobject(item.key(), item.value());
+      }
+      auto vertices = feature.find("vertices");
+      if (vertices == feature.end()) return;
+      vertex_vec.clear();
+      for (auto& vertex : *vertices) {
+        vertex_vec.push_back({vertex[0].template get<int64_t>(), vertex[1].template get<int64_t>(), vertex[2].template get<int64_t>()});
+        if (recompute_offset_) {
+          bbox.add(arr3f{
+            (float) int(vertex_vec.back()[0]) * scale[0],
+            (float) int(vertex_vec.back()[1]) * scale[1],
+            (float) int(vertex_vec.back()[2]) * scale[2]
+          });
+        }
+      }
+      stream.add_vertices(vertex_vec);
+    };
+    // the first line goes first, also if it only has vertices
+    write_feature(metajson);
+
+    for_each_cityjson_feature(vector_input("features"), optimal_lod_, stream.n_vertices(), n_threads_, write_feature);
+
+    // same as the in-memory mode, up to the float rounding
+    std::array<double,3> shift = {0, 0, 0};
+    if(recompute_offset_) {
+      auto c = bbox.center();
+      for (size_t k = 0; k < 3; ++k) {
+        t[k] = t[k].get<float>() + c[k];
+        shift[k] = double(c[k]/s[k].get<double>());
+      }
+    }
+    arr3f translate = {t[0].get<float>(), t[1].get<float>(), t[2].get<float>()};
+
+    out << "},\"vertices\":[";
+    Box extent;
+    stream.write_vertices([&](const QuantizedVertex& vertex) {
+      std::array<int,3> v = {
+        int( double(vertex[0]) - shift[0] ),
+        int( double(vertex[1]) - shift[1] ),
+        int( double(vertex[2]) - shift[2] )
+      };
+      extent.add(arr3f{
+        (float) v[0] * scale[0] + translate[0],
+        (float) v[1] * scale[1] + translate[1],
+        (float) v[2] * scale[2] + translate[2]
+      });
+      return v;
+    });
+
+    metajson["metadata"]["geographicalExtent"] = CityJSON::compute_geographical_extent(extent, manager);
+    out << "],\"transform\":";
+    stream.emitter.write_exact(metajson["transform"]);
+    out << ",\"metadata\":";
+    stream.emitter.write(metajson["metadata"]);
+    out << '}';
+    stream.close();
   }
 
   std::set<std::string> split_string(const std::string& s, std::string delimiter) {
@@ -809,23 +1690,38 @@ namespace geoflow::nodes::basic3d
     return parts;
   }
 
-  LinearRing CityJSONSurface2LinearRing(
-    std::vector<std::vector<int>> face,
-    const std::vector<std::vector<double>>& vertices,
+  // Decodes the vertices of a CityJSONFeature and transforms them to the process CRS.
+  std::vector<arr3f> CityJSONFeatureVertices(
+    const ArenaJSON& jvertices,
     const std::vector<double>& jtranslate,
     const std::vector<double>& jscale,
-    geoflow::NodeManager&  manager
+    CRSTransform& transform
+  ) {
+    CoordBatch batch;
+    batch.reserve(jvertices.size());
+    for (const auto& v : jvertices) {
+      batch.push_back(
+        (v[0].get<double>() * jscale[0])+jtranslate[0],
+        (v[1].get<double>() * jscale[1])+jtranslate[1],
+        (v[2].get<double>() * jscale[2])+jtranslate[2]
+      );
+    }
+    transform.transform_fwd(batch);
+    std::vector<arr3f> points;
+    points.reserve(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+      points.push_back(batch.get_float(i));
+    }
+    return points;
+  }
+
+  LinearRing CityJSONSurface2LinearRing(
+    const ArenaJSON& face,
+    const std::vector<arr3f>& points
   ) {
     LinearRing ring;
     for (const auto& i : face[0]) { // get vertices of exterior ring (skipping holes)
-      ring.push_back(
-        manager.coord_transform_fwd(
-          double((vertices[i][0] * jscale[0])+jtranslate[0]),
-          double((vertices[i][1] * jscale[1])+jtranslate[1]),
-          double((vertices[i][2] * jscale[2])+jtranslate[2])
-        )
-      );
-      // get the surface type
+      ring.push_back(points[i.get<size_t>()]);
     }
     return ring;
   }
@@ -859,6 +1755,10 @@ namespace geoflow::nodes::basic3d
     } else {
       throw(gfException("CRS not detected"));
     }
+    auto& transform = crs_transform_;
+    transform.start_run(epsg_code);
+    // memory of the feature that is being read, reused for every feature
+    JSONArena arena;
 
     auto feature_filter = split_string(manager.substitute_globals(cotypes), ",");
     for(auto& t : feature_filter) {
@@ -898,9 +1798,11 @@ namespace geoflow::nodes::basic3d
           continue;
         }
         // std::cout<< featurestr << std::endl;
-        nlohmann::json feature;
+        arena.reset();
+        JSONArenaScope arena_scope(arena);
+        ArenaJSON feature;
         try {
-          feature = nlohmann::json::parse(featurestr);
+          feature = ArenaJSON::parse(featurestr);
         } catch (const std::exception& e) {
           throw(gfIOError(e.what()));
         }
@@ -908,7 +1810,7 @@ namespace geoflow::nodes::basic3d
         if(feature["type"] != "CityJSONFeature") {
           throw(gfException("input is not CityJSONFeature"));
         }
-        std::vector<std::vector<double>> vertices = feature["vertices"];
+        auto points = CityJSONFeatureVertices(feature["vertices"], jtranslate, jscale, transform);
         size_t n_attr=0, n_mesh=0;
         std::string optimal_lod_value = optimal_lod_value_;
         for( auto [id, cobject] : feature["CityObjects"].items() ) {
@@ -920,13 +1822,17 @@ namespace geoflow::nodes::basic3d
 
             if (cobject["attributes"].contains("b3_succes")) {
               if (cobject["attributes"]["b3_succes"].is_null() || cobject["attributes"]["b3_succes"].get<bool>() == false) {
+                transform.report("CityJSONL2Mesh");
                 return;
               }
             }
 
             size_t n_children = 1;
             if (bag3d_attr_per_part_) n_children = cobject["children"].size();
-            if (n_children==0) return;
+            if (n_children==0) {
+              transform.report("CityJSONL2Mesh");
+              return;
+            }
             n_attr += n_children;
             // get_attributes
             for(auto& [jname, jval] : cobject["attributes"].items()) {
@@ -1033,7 +1939,7 @@ namespace geoflow::nodes::basic3d
             auto& geom = cobject["geometry"][0];
             LinearRing ring;
             if(geom["type"] == "MultiSurface" && geom["lod"] == "0") {
-              ring = CityJSONSurface2LinearRing( geom["boundaries"][0], vertices, jtranslate, jscale, manager );
+              ring = CityJSONSurface2LinearRing( geom["boundaries"][0], points );
               lod0_2d.push_back(ring);
             } else {
               throw(gfException("Building geometry has unexpected form"));
@@ -1066,13 +1972,7 @@ namespace geoflow::nodes::basic3d
                   for (const auto& ext_face : geom["boundaries"][0]) {
                     LinearRing ring;
                     for (const auto& i : ext_face[0]) { // get vertices of outer rings
-                      ring.push_back(
-                        manager.coord_transform_fwd(
-                          double((vertices[i][0] * jscale[0])+jtranslate[0]),
-                          double((vertices[i][1] * jscale[1])+jtranslate[1]),
-                          double((vertices[i][2] * jscale[2])+jtranslate[2])
-                        )
-                      );
+                      ring.push_back(points[i.get<size_t>()]);
                       // get the surface type
                     }
                     int sindex = geom["semantics"]["values"][0][face_i++].get<int>();
@@ -1192,9 +2092,11 @@ namespace geoflow::nodes::basic3d
           continue;
         }
         // std::cout<< featurestr << std::endl;
-        nlohmann::json feature;
+        arena.reset();
+        JSONArenaScope arena_scope(arena);
+        ArenaJSON feature;
         try {
-          feature = nlohmann::json::parse(featurestr);
+          feature = ArenaJSON::parse(featurestr);
         } catch (const std::exception& e) {
           throw(gfIOError(e.what()));
         }
@@ -1203,7 +2105,7 @@ namespace geoflow::nodes::basic3d
           throw(gfException("input is not CityJSONFeature"));
         }
         size_t n_attr=0, n_mesh=0;
-        std::vector<std::vector<double>> vertices = feature["vertices"];
+        auto points = CityJSONFeatureVertices(feature["vertices"], jtranslate, jscale, transform);
         // we can only push once the attributes per CityObject
         auto pushed_attributes = false;
         for( auto [id, cobject] : feature["CityObjects"].items() ) {
@@ -1249,13 +2151,7 @@ namespace geoflow::nodes::basic3d
               for (const auto& ext_face : geom["boundaries"][0]) {
                 LinearRing ring;
                 for (const auto& i : ext_face[0]) { // get vertices of outer rings
-                  ring.push_back(
-                    manager.coord_transform_fwd(
-                      float((vertices[i][0] * jscale[0])+jtranslate[0]),
-                      float((vertices[i][1] * jscale[1])+jtranslate[1]),
-                      float((vertices[i][2] * jscale[2])+jtranslate[2])
-                    )
-                  );
+                  ring.push_back(points[i.get<size_t>()]);
                   // get the surface type
                 }
                 mesh.push_polygon(ring, 2);
@@ -1268,13 +2164,7 @@ namespace geoflow::nodes::basic3d
               for (const auto& ext_face : geom["boundaries"]) {
                 LinearRing ring;
                 for (const auto& i : ext_face[0]) { // get vertices of outer rings
-                  ring.push_back(
-                    manager.coord_transform_fwd(
-                      float((vertices[i][0] * jscale[0])+jtranslate[0]),
-                      float((vertices[i][1] * jscale[1])+jtranslate[1]),
-                      float((vertices[i][2] * jscale[2])+jtranslate[2])
-                    )
-                  );
+                  ring.push_back(points[i.get<size_t>()]);
                   // get the surface type
                 }
                 mesh.push_polygon(ring, 2);
@@ -1291,7 +2181,14 @@ namespace geoflow::nodes::basic3d
                 //check if the feature has a parent
                 if(cobject.contains("parents") && cobject["parents"].size() > 0){
                     auto& ref = cobject["parents"][0];
-                    jattributes = feature["CityObjects"][ ref ] ["attributes"];
+                    // find(), inserting a missing parent would invalidate cobject. A parent
+                    // that is not in this feature leaves the attributes of the object itself.
+                    auto& cityobjects = feature["CityObjects"];
+                    auto parent = cityobjects.find( ref.get<std::string>() );
+                    if (parent != cityobjects.end()) {
+                      auto parent_attributes = parent->find("attributes");
+                      jattributes = parent_attributes != parent->end() ? *parent_attributes : ArenaJSON();
+                    }
                 }
             }
 
@@ -1367,8 +2264,7 @@ namespace geoflow::nodes::basic3d
         }
       }
     }
-
-
+    transform.report("CityJSONL2Mesh");
   }
 
 
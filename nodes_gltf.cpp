@@ -14,6 +14,8 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "nodes.hpp"
+#include "crs_transform.hpp"
+#include "normal_jacobian.hpp"
 #include <cstdint>
 #include <limits>
 #include <regex>
@@ -38,7 +40,8 @@ namespace geoflow::nodes::basic3d
     std::unordered_map<std::string, unsigned> ftype_counts;
 
     arr3f center_point;
-    NodeManager& manager;
+    CRSTransform& transform;
+    CoordBatch batch;
     bool relative_to_center;
 
     float feature_id_cnt = 0.0;
@@ -46,9 +49,9 @@ namespace geoflow::nodes::basic3d
 
     AttributeDataHelper(
       const arr3f& center_point,
-      NodeManager& manager,
+      CRSTransform& transform,
       bool& relative_to_center
-    ) : center_point(center_point), manager(manager), relative_to_center(relative_to_center)
+    ) : center_point(center_point), transform(transform), relative_to_center(relative_to_center)
     {
     }
 
@@ -60,35 +63,41 @@ namespace geoflow::nodes::basic3d
       return total;
     }
 
+    // Transforms the feature with the transform of the helper.
     void add_feature(
       const std::string& feature_type,
       const TriangleCollection& tc,
       const vec3f& normals
     ) {
 
-      // count the nr of vertices and indices stored for this tc
-      // std::set<arr6f> vertex_set;
-      // std::map<arr6f, unsigned> vertex_map;
-      size_t i = 0, v_cntr = 0;
-      for (auto &triangle : tc)
-      {
-        for (auto &p_ : triangle)
+      size_t n_points = 0;
+      for (auto &triangle : tc) n_points += triangle.size();
+      if (n_points > 0) {
+        // Transform all points, followed by the first point offset by a
+        // unit step along each axis. From those the Jacobian of the transform is
+        // estimated once for the feature and the normals are reprojected with it,
+        // instead of transforming every point offset by its normal.
+        NormalJacobian jacobian(tc[0][0]);
+        batch.clear();
+        batch.reserve(n_points + 3);
+        for (auto &triangle : tc)
         {
-          const auto& n_ = normals[i];
-          // normal is 0 for a degenerate triangle. skip such points
-          // if(!std::isnormal(n_[0]) && !std::isnormal(n_[1]) && !std::isnormal(n_[2])) {
-          //   std::cout << "n = " << n_[0] << " " << n_[1] << " " << n_[2] << "\n";
-          //   std::cout << "skipping point\n";
-          //   break;
-          // }
-          i++;
-
-          auto p = manager.coord_transform_rev(p_);
-          // NB: narrowing double to float here, not ideal
-          // reproject n_
-          arr3f pn_{p_[0]+n_[0], p_[1]+n_[1], p_[2]+n_[2]};
-          auto pn = manager.coord_transform_rev(pn_);
-          arr3f n{float(pn[0]-p[0]), float(pn[1]-p[1]), float(pn[2]-p[2])};
+          for (auto &p_ : triangle)
+          {
+            batch.push_back(p_);
+          }
+        }
+        for (size_t k = 0; k < 3; ++k) {
+          batch.push_back(jacobian.step_point(k));
+        }
+        transform.transform_rev(batch);
+        jacobian.estimate(batch[0], {batch[n_points], batch[n_points + 1], batch[n_points + 2]});
+
+        for (size_t j = 0; j < n_points; ++j)
+        {
+          auto p = batch[j];
+          // normal is 0 for a degenerate triangle
+          auto n = jacobian.apply(normals[j]);
           auto l = std::sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
 
           if(relative_to_center) {
@@ -930,9 +939,13 @@ namespace geoflow::nodes::basic3d
     auto& attributes_inp = poly_input("attributes");
 
     // set CRS
-    manager.set_rev_crs_transform(manager.substitute_globals(CRS_).c_str());
+    auto CRS = manager.substitute_globals(CRS_);
+    manager.set_rev_crs_transform(CRS.c_str());
+    auto& transform = crs_transform_;
+    transform.start_run(CRS);
 
     // determine approximate centerpoint
+    CoordBatch batch;
     Box global_bbox;
     std::cout << "tc count="<<triangle_collections_inp.size()<<std::endl;
     for (unsigned i = 0; i < triangle_collections_inp.size(); ++i) {
@@ -940,26 +953,31 @@ namespace geoflow::nodes::basic3d
         std::cout << "skip tc i="<<i<<std::endl;
         continue;
       }
-      auto tc = triangle_collections_inp.get<TriangleCollection>(i);
+      const auto& tc = triangle_collections_inp.get<TriangleCollection>(i);
       if (tc.vertex_count() == 0) {
         std::cout << "skip tc i="<<i<<std::endl;
         continue;
       }
+      batch.clear();
       for (auto &triangle : tc) {
         for (auto &p : triangle) {
-          global_bbox.add(manager.coord_transform_rev(p));
+          batch.push_back(p);
         }
       }
+      transform.transform_rev(batch);
+      for (size_t j = 0; j < batch.size(); ++j) {
+        global_bbox.add(batch[j]);
+      }
     }
     arr3f gcenter = global_bbox.center();
 
     // create intermediate vectors
-    AttributeDataHelper iData(gcenter, manager, relative_to_center);
+    AttributeDataHelper iData(gcenter, transform, relative_to_center);
 
     for (unsigned i = 0; i < triangle_collections_inp.size(); ++i) {
       if (!triangle_collections_inp.get_data_vec()[i].has_value())
         continue;
-      const auto tc = triangle_collections_inp.get<TriangleCollection>(i);
+      const auto& tc = triangle_collections_inp.get<TriangleCollection>(i);
       if (tc.vertex_count() == 0)
         continue;
 
@@ -973,6 +991,7 @@ namespace geoflow::nodes::basic3d
     }
 
     // clear CRS; we are done reading coordinates
+    transform.report("GLTFWriter");
     manager.clear_rev_crs_transform();
 
     if (iData.total_count == 0) {
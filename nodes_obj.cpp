@@ -14,6 +14,9 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "nodes.hpp"
+#include "vertex_index.hpp"
+#include "text_writer.hpp"
+#include "thread_pool.hpp"
 #include <iomanip>
 #include <filesystem>
 
@@ -50,82 +53,82 @@ const std::string mtl_text =
 
 namespace geoflow::nodes::basic3d
 {
-void OBJWriterNode::process()
-{
-  //auto& t_in = vector_input("triangles");
-  //std::vector<Triangle> triangles;
-  //for (size_t i = 0; i < t_in.size(); ++i) {
-  //  triangles.push_back(t_in.get<Triangle>(i));
-  //}
-
-  auto &triangles = input("triangles").get<TriangleCollection>();
-
-  std::map<arr3f, size_t> vertex_map;
-  std::vector<arr3f> vertex_vec;
+// Appends the unique vertices of tc to vertex_vec and the (1-based) vertex index of
+// each triangle corner to face_indices, so the faces can be written without further lookups.
+// index_offset is the number of vertices already written to the file before vertex_vec.
+void add_vertices(VertexIndex<arr3f>& vertex_index, std::vector<arr3f>& vertex_vec, std::vector<size_t>& face_indices, const TriangleCollection& tc, size_t index_offset=0) {
+  face_indices.reserve(face_indices.size() + 3*tc.size());
+  for (auto &triangle : tc)
   {
-    size_t v_cntr = 1;
-    std::set<arr3f> vertex_set;
-    for (auto &triangle : triangles)
+    for (auto &vertex : triangle)
     {
-      for (auto &vertex : triangle)
+      auto [v_idx, did_insert] = vertex_index.insert(vertex, index_offset+vertex_vec.size()+1);
+      if (did_insert)
       {
-        auto [it, did_insert] = vertex_set.insert(vertex);
-        if (did_insert)
-        {
-          vertex_map[vertex] = v_cntr++;
-          vertex_vec.push_back(vertex);
-        }
+        vertex_vec.push_back(vertex);
       }
+      face_indices.push_back(v_idx);
     }
   }
-  std::ofstream ofs;
-  ofs.open(manager.substitute_globals(filepath));
-  ofs << std::fixed << std::setprecision(precision);
-  for (auto &v : vertex_vec)
+}
+
+// offset is the global data offset to add to each vertex, or nullptr to write the vertices as they are.
+// Only the vertices in the range [begin, end) of vertex_vec are written.
+void write_vertices(TextWriter& ofs, const std::vector<arr3f>& vertex_vec, const arr3d* offset, size_t begin=0, size_t end=size_t(-1)) {
+  end = std::min(end, vertex_vec.size());
+  for (size_t i = begin; i < end; ++i)
   {
-    if (no_offset)
+    auto &v = vertex_vec[i];
+    if (offset == nullptr)
       ofs << "v " << v[0] << " " << v[1] << " " << v[2] << "\n";
     else
-      ofs << "v " << v[0] + (*manager.data_offset())[0] << " " << v[1] + (*manager.data_offset())[1] << " " << v[2] + (*manager.data_offset())[2] << "\n";
-  }
-  for (auto &triangle : triangles)
-  {
-    ofs << "f " << vertex_map[triangle[0]] << " " << vertex_map[triangle[1]] << " " << vertex_map[triangle[2]] << std::endl;
+      ofs << "v " << v[0] + (*offset)[0] << " " << v[1] + (*offset)[1] << " " << v[2] + (*offset)[2] << "\n";
   }
-  ofs.close();
 }
 
-void add_vertices(std::map<arr3f, size_t>& vertex_map, std::vector<arr3f>& vertex_vec, std::set<arr3f>& vertex_set, const TriangleCollection& tc) {
-  size_t v_cntr = vertex_vec.size();
-  for (auto &triangle : tc)
+// fi is the position of the first corner of tc in face_indices, it is advanced past the last corner of tc
+void write_triangles(const TriangleCollection& tc, TextWriter& ofs, const std::vector<size_t>& face_indices, size_t& fi) {
+  for (size_t i=0; i< tc.size(); ++i, fi+=3)
   {
-    for (auto &vertex : triangle)
-    {
-      auto [it, did_insert] = vertex_set.insert(vertex);
-      if (did_insert)
-      {
-        vertex_map[vertex] = ++v_cntr;
-        vertex_vec.push_back(vertex);
-      }
-    }
+    ofs << "f " << face_indices[fi] << " " << face_indices[fi+1] << " " << face_indices[fi+2] << "\n";
   }
 }
 
-void write_triangles(const TriangleCollection& tc, std::ofstream& ofs, std::map<arr3f, size_t>& vertex_map) {
-  for (auto &triangle : tc)
+void write_triangles(const TriangleCollection& tc, const std::vector<attribute_value>& attr, TextWriter& ofs, const std::vector<size_t>& face_indices, size_t& fi) {
+  for (size_t i=0; i< tc.size(); ++i, fi+=3)
   {
-    ofs << "f " << vertex_map[triangle[0]] << " " << vertex_map[triangle[1]] << " " << vertex_map[triangle[2]] << "\n";
+    auto& label = std::get<int>(attr[i]);
+    ofs << "usemtl " << label << "\n";
+    ofs << "f " << face_indices[fi] << " " << face_indices[fi+1] << " " << face_indices[fi+2] << "\n";
   }
 }
 
-void write_triangles(const TriangleCollection& tc, const std::vector<attribute_value>& attr, std::ofstream& ofs, std::map<arr3f, size_t>& vertex_map) {
-  for (size_t i=0; i< tc.size(); ++i)
+void OBJWriterNode::process()
+{
+  //auto& t_in = vector_input("triangles");
+  //std::vector<Triangle> triangles;
+  //for (size_t i = 0; i < t_in.size(); ++i) {
+  //  triangles.push_back(t_in.get<Triangle>(i));
+  //}
+
+  auto &triangles = input("triangles").get<TriangleCollection>();
+
+  std::vector<arr3f> vertex_vec;
+  std::vector<size_t> face_indices;
   {
-    auto& triangle = tc[i];
-    auto& label = std::get<int>(attr[i]);
-    ofs << "usemtl " << label << "\n";
-    ofs << "f " << vertex_map[triangle[0]] << " " << vertex_map[triangle[1]] << " " << vertex_map[triangle[2]] << "\n";
+    VertexIndex<arr3f> vertex_index(triangles.size());
+    add_vertices(vertex_index, vertex_vec, face_indices, triangles);
+  }
+  std::ofstream ofs_file;
+  ofs_file.open(manager.substitute_globals(filepath));
+  TextWriter ofs(ofs_file, precision);
+  write_vertices(ofs, vertex_vec, no_offset ? nullptr : &(*manager.data_offset()));
+  for (size_t fi = 0; fi < face_indices.size(); fi += 3)
+  {
+    ofs << "f " << face_indices[fi] << " " << face_indices[fi+1] << " " << face_indices[fi+2] << "\n";
   }
+  ofs.flush();
+  ofs_file.close();
 }
 
 void VecOBJWriterNode::process()
@@ -141,52 +144,56 @@ void VecOBJWriterNode::process()
       use_id_from_attribute = true;
     }
   }
+  const arr3d* offset = no_offset ? nullptr : &(*manager.data_offset());
   
-  std::map<arr3f, size_t> vertex_map;
   std::vector<arr3f> vertex_vec;
+  std::vector<size_t> face_indices;
+  size_t fi = 0;
   
   if(triangles.is_connected_type(typeid(TriangleCollection))) {
-    {
-      std::set<arr3f> vertex_set;
+    std::ofstream ofs_file;
+    ofs_file.open(manager.substitute_globals(filepath));
+    TextWriter ofs(ofs_file, precision);
+    if (streaming) {
+      // every object gets its own vertices, so only one object needs to be kept in memory
+      VertexIndex<arr3f> vertex_index;
+      size_t v_offset = 0;
       for (size_t j = 0; j < triangles.size(); ++j)
       {
         if(!triangles.get_data_vec()[j].has_value()) continue;
         const auto& tc = triangles.get<TriangleCollection>(j);
-        add_vertices(vertex_map, vertex_vec, vertex_set, tc);
+        vertex_index.clear();
+        vertex_vec.clear();
+        face_indices.clear();
+        fi = 0;
+        add_vertices(vertex_index, vertex_vec, face_indices, tc, v_offset);
+        ofs << "o " << j << "\n";
+        write_vertices(ofs, vertex_vec, offset);
+        write_triangles(tc, ofs, face_indices, fi);
+        v_offset += vertex_vec.size();
       }
-    }
-    std::ofstream ofs;
-    ofs.open(manager.substitute_globals(filepath));
-    ofs << std::fixed << std::setprecision(precision);
-    for (auto &v : vertex_vec)
-    {
-      if (no_offset)
-        ofs << "v " << v[0] << " " << v[1] << " " << v[2] << "\n";
-      else
-        ofs << "v " << v[0] + (*manager.data_offset())[0] << " " << v[1] + (*manager.data_offset())[1] << " " << v[2] + (*manager.data_offset())[2] << "\n";
-    }
-    for (size_t j = 0; j < triangles.size(); ++j)
-    {
-      if(!triangles.get_data_vec()[j].has_value()) continue;
-      ofs << "o " << j << "\n";
-      write_triangles(triangles.get<TriangleCollection>(j), ofs, vertex_map);
-    }
-    ofs.close();
-  } else if(triangles.is_connected_type(typeid(MultiTriangleCollection))) {
-
-    {
-      std::set<arr3f> vertex_set;
+    } else {
+      {
+        VertexIndex<arr3f> vertex_index;
+        for (size_t j = 0; j < triangles.size(); ++j)
+        {
+          if(!triangles.get_data_vec()[j].has_value()) continue;
+          const auto& tc = triangles.get<TriangleCollection>(j);
+          add_vertices(vertex_index, vertex_vec, face_indices, tc);
+        }
+      }
+      write_vertices(ofs, vertex_vec, offset);
       for (size_t j = 0; j < triangles.size(); ++j)
       {
         if(!triangles.get_data_vec()[j].has_value()) continue;
-        
-        auto& mtcs = triangles.get<MultiTriangleCollection>(j);
-        for(size_t i=0; i<mtcs.tri_size(); i++) {
-          const auto& tc = mtcs.tri_at(i);
-          add_vertices(vertex_map, vertex_vec, vertex_set, tc);
-        }
+        ofs << "o " << j << "\n";
+        write_triangles(triangles.get<TriangleCollection>(j), ofs, face_indices, fi);
       }
     }
+    ofs.flush();
+    ofs_file.close();
+  } else if(triangles.is_connected_type(typeid(MultiTriangleCollection))) {
+
     auto fname = manager.substitute_globals(filepath);
     fname = substitute_from_term(fname, poly_input("attributes"));
     auto mtl_path = fs::path(fname+".mtl");
@@ -200,35 +207,107 @@ void VecOBJWriterNode::process()
     ofs_mtl << mtl_text;
     ofs_mtl.close();
     
-    std::ofstream ofs;
-    ofs.open(fname);
+    std::ofstream ofs_file;
+    ofs_file.open(fname);
+    TextWriter ofs(ofs_file, precision);
     ofs << "# Created by Geoflow\n";
     ofs << "# " << manager.substitute_globals(headerline_) << "\n";
     ofs << "mtllib " << mtl_path.filename().c_str() << "\n";
-    ofs << std::fixed << std::setprecision(precision);
-    for (auto &v : vertex_vec)
-    {
-      if (no_offset)
-        ofs << "v " << v[0] << " " << v[1] << " " << v[2] << "\n";
-      else
-        ofs << "v " << v[0] + (*manager.data_offset())[0] << " " << v[1] + (*manager.data_offset())[1] << " " << v[2] + (*manager.data_offset())[2] << "\n";
+
+    // Objects are formatted in batches on the thread pool, each object into its own
+    // in-memory block. The blocks are then written in input order, so the output
+    // does not depend on the number of threads.
+    ThreadPool pool(n_threads);
+    const size_t batch_size = 16 * pool.size();
+    std::vector<TextWriter> blocks;
+    for (size_t k = 0; k < batch_size; ++k) blocks.emplace_back(precision);
+
+    // position of the first corner of each object in face_indices
+    std::vector<size_t> feature_fi(triangles.size(), 0);
+    if (!streaming) {
+      {
+        VertexIndex<arr3f> vertex_index;
+        for (size_t j = 0; j < triangles.size(); ++j)
+        {
+          if(!triangles.get_data_vec()[j].has_value()) continue;
+          
+          feature_fi[j] = face_indices.size();
+          auto& mtcs = triangles.get<MultiTriangleCollection>(j);
+          for(size_t i=0; i<mtcs.tri_size(); i++) {
+            const auto& tc = mtcs.tri_at(i);
+            add_vertices(vertex_index, vertex_vec, face_indices, tc);
+          }
+        }
+      }
+      const size_t chunk_size = 4096;
+      size_t n_chunks = (vertex_vec.size() + chunk_size - 1) / chunk_size;
+      for (size_t c = 0; c < n_chunks; c += batch_size) {
+        size_t n = std::min(batch_size, n_chunks - c);
+        pool.parallel_for(n, [&](size_t k, size_t) {
+          blocks[k].clear();
+          write_vertices(blocks[k], vertex_vec, offset, (c+k)*chunk_size, (c+k+1)*chunk_size);
+        });
+        for (size_t k = 0; k < n; ++k) ofs << blocks[k].view();
+      }
     }
-    for (size_t j = 0; j < triangles.size(); ++j)
+
+    // in streaming mode every object gets its own vertices, so only one batch of objects needs to be kept in memory
+    std::vector<std::vector<arr3f>> batch_vertices(streaming ? batch_size : 0);
+    std::vector<std::vector<size_t>> batch_face_indices(streaming ? batch_size : 0);
+    std::vector<VertexIndex<arr3f>> thread_vertex_index(streaming ? pool.size() : 0);
+    size_t v_offset = 0;
+    for (size_t j0 = 0; j0 < triangles.size(); j0 += batch_size)
     {
-      if(!triangles.get_data_vec()[j].has_value()) continue;
-      if (use_id_from_attribute) {
-        ofs << "o " << id_term->get<const std::string>(j) << "-" << j << "\n";
-      } else {
-        ofs << "o " << j << "\n";
+      size_t n = std::min(batch_size, triangles.size() - j0);
+      if (streaming) {
+        pool.parallel_for(n, [&](size_t k, size_t thread_id) {
+          size_t j = j0 + k;
+          batch_vertices[k].clear();
+          batch_face_indices[k].clear();
+          if(!triangles.get_data_vec()[j].has_value()) return;
+          auto& vertex_index = thread_vertex_index[thread_id];
+          vertex_index.clear();
+          auto& mtcs = triangles.get<MultiTriangleCollection>(j);
+          for(size_t i=0; i<mtcs.tri_size(); i++) {
+            add_vertices(vertex_index, batch_vertices[k], batch_face_indices[k], mtcs.tri_at(i));
+          }
+        });
       }
-      auto mtcs = triangles.get<MultiTriangleCollection>(j);
-      for(size_t i=0; i<mtcs.tri_size(); i++) {
-          const auto& tc = mtcs.tri_at(i);
-          const auto& am = mtcs.attr_at(i)["labels"];
-        write_triangles(tc, am, ofs, vertex_map);
+      // vertex index offset of each object is the prefix sum of the vertex counts
+      std::vector<size_t> batch_v_offset(n, 0);
+      if (streaming) {
+        for (size_t k = 0; k < n; ++k) {
+          batch_v_offset[k] = v_offset;
+          v_offset += batch_vertices[k].size();
+        }
       }
+      pool.parallel_for(n, [&](size_t k, size_t) {
+        size_t j = j0 + k;
+        auto& block = blocks[k];
+        block.clear();
+        if(!triangles.get_data_vec()[j].has_value()) return;
+        if (use_id_from_attribute) {
+          block << "o " << id_term->get<const std::string>(j) << "-" << j << "\n";
+        } else {
+          block << "o " << j << "\n";
+        }
+        size_t fi = feature_fi[j];
+        if (streaming) {
+          write_vertices(block, batch_vertices[k], offset);
+          for (auto& idx : batch_face_indices[k]) idx += batch_v_offset[k];
+          fi = 0;
+        }
+        auto mtcs = triangles.get<MultiTriangleCollection>(j);
+        for(size_t i=0; i<mtcs.tri_size(); i++) {
+            const auto& tc = mtcs.tri_at(i);
+            const auto& am = mtcs.attr_at(i)["labels"];
+          write_triangles(tc, am, block, streaming ? batch_face_indices[k] : face_indices, fi);
+        }
+      });
+      for (size_t k = 0; k < n; ++k) ofs << blocks[k].view();
     }
-    ofs.close();
+    ofs.flush();
+    ofs_file.close();
   }
 }
 
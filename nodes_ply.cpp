@@ -15,20 +15,259 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "nodes.hpp"
 #include "happly.h"
+#include "thread_pool.hpp"
+#include "vertex_index.hpp"
 #include <filesystem>
+#include <cstring>
+#include <charconv>
+#include <sstream>
+#include <algorithm>
+#include <limits>
+
+#ifdef WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace fs = std::filesystem;
 
 namespace geoflow::nodes::basic3d
 {
 
+bool is_little_endian() {
+  const uint16_t endian_check = 1;
+  return *(const uint8_t*)&endian_check == 1;
+}
+
+// An attribute terminal and the native PLY type its values are written as
+struct PLYColumn {
+  enum Type { UCHAR, INT, FLOAT, DOUBLE };
+  const gfSingleFeatureOutputTerminal* term;
+  Type type;
+  bool from_bool = false;
+
+  PLYColumn(const gfSingleFeatureOutputTerminal* term) : term(term) {
+    if (term->accepts_type(typeid(float))) {
+      type = FLOAT;
+    } else if (term->accepts_type(typeid(int))) {
+      type = INT;
+    } else if (term->accepts_type(typeid(bool)) || term->accepts_type(typeid(uint8_t))) {
+      type = UCHAR;
+      from_bool = term->accepts_type(typeid(bool));
+    } else if (term->accepts_type(typeid(double))) {
+      type = DOUBLE;
+    } else {
+      throw(gfException("PLY attribute " + term->get_name() + " is not of type float, int, bool, uint8 or double"));
+    }
+  }
+
+  const char* type_name() const {
+    switch (type) {
+      case UCHAR: return "uchar";
+      case INT: return "int";
+      case FLOAT: return "float";
+      default: return "double";
+    }
+  }
+
+  size_t byte_size() const {
+    switch (type) {
+      case UCHAR: return sizeof(uint8_t);
+      case INT: return sizeof(int32_t);
+      case FLOAT: return sizeof(float);
+      default: return sizeof(double);
+    }
+  }
+
+  // copies value i to dst and returns the position just after it
+  char* write(char* dst, size_t i) const {
+    switch (type) {
+      case UCHAR: {
+        uint8_t v = from_bool ? uint8_t(term->get<const bool&>(i)) : term->get<const uint8_t&>(i);
+        *dst = char(v);
+        return dst + 1;
+      }
+      case INT: {
+        int32_t v = term->get<const int&>(i);
+        std::memcpy(dst, &v, sizeof(v));
+        return dst + sizeof(v);
+      }
+      case FLOAT: {
+        std::memcpy(dst, &term->get<const float&>(i), sizeof(float));
+        return dst + sizeof(float);
+      }
+      default: {
+        std::memcpy(dst, &term->get<const double&>(i), sizeof(double));
+        return dst + sizeof(double);
+      }
+    }
+  }
+
+  // adds the values as a property with the native type to a happly element
+  void add_to(happly::Element& element, size_t N) const {
+    switch (type) {
+      case UCHAR: {
+        std::vector<uint8_t> vec(N);
+        for (size_t i = 0; i < N; ++i) write((char*)&vec[i], i);
+        element.addProperty<uint8_t>(term->get_name(), vec);
+        break;
+      }
+      case INT: {
+        std::vector<int32_t> vec(N);
+        for (size_t i = 0; i < N; ++i) vec[i] = term->get<const int&>(i);
+        element.addProperty<int32_t>(term->get_name(), vec);
+        break;
+      }
+      case FLOAT: {
+        vec1f vec(N);
+        for (size_t i = 0; i < N; ++i) vec[i] = term->get<const float&>(i);
+        element.addProperty<float>(term->get_name(), vec);
+        break;
+      }
+      default: {
+        std::vector<double> vec(N);
+        for (size_t i = 0; i < N; ++i) vec[i] = term->get<const double&>(i);
+        element.addProperty<double>(term->get_name(), vec);
+      }
+    }
+  }
+};
+
+// Width of the vertex count in the header of a PLY file that is appended to, so the
+// count can be updated in place. This fits any 64 bit count.
+const size_t ply_count_width = 20;
+
+// Writes the header of a binary little endian PLY file with a single vertex element.
+// With fixed_width_count the vertex count is padded with spaces to ply_count_width
+// characters. Returns the stream position of the vertex count.
+std::streampos write_ply_header(std::ostream& os, size_t N, const std::vector<PLYColumn>& columns, bool fixed_width_count=false) {
+  if (!is_little_endian()) {
+    throw(gfIOError("binary PLY writing assumes a little endian system"));
+  }
+  os << "ply\n";
+  os << "format binary_little_endian 1.0\n";
+  os << "comment Created by Geoflow\n";
+  os << "element vertex ";
+  auto count_pos = os.tellp();
+  if (fixed_width_count)
+    os << std::left << std::setw(ply_count_width) << N << "\n";
+  else
+    os << N << "\n";
+  os << "property float x\n";
+  os << "property float y\n";
+  os << "property float z\n";
+  for (auto& col : columns) {
+    os << "property " << col.type_name() << " " << col.term->get_name() << "\n";
+  }
+  os << "end_header\n";
+  return count_pos;
+}
+
+// Writes records of record_size bytes to os in blocks of about 1 MiB. fill(dst, i)
+// writes record i to dst.
+template <typename F> void write_ply_blocks(std::ostream& os, size_t n_records, size_t record_size, F&& fill) {
+  const size_t block_records = std::max<size_t>(1, (size_t(1) << 20) / record_size);
+  std::vector<char> block(block_records * record_size);
+  for (size_t i0 = 0; i0 < n_records; i0 += block_records) {
+    size_t n = std::min(block_records, n_records - i0);
+    for (size_t i = i0; i < i0 + n; ++i) {
+      fill(block.data() + (i - i0) * record_size, i);
+    }
+    os.write(block.data(), n * record_size);
+  }
+}
+
+// Writes the binary vertex records without building an intermediate happly::PLYData.
+// The records are interleaved in a block buffer straight from the PointCollection and
+// the attribute terminals.
+void write_ply_records(std::ostream& os, const PointCollection& points, const std::vector<PLYColumn>& columns) {
+  size_t record_size = 3 * sizeof(float);
+  for (auto& col : columns) {
+    record_size += col.byte_size();
+  }
+  write_ply_blocks(os, points.size(), record_size, [&](char* rec, size_t i) {
+    std::memcpy(rec, points[i].data(), 3 * sizeof(float));
+    rec += 3 * sizeof(float);
+    for (auto& col : columns) {
+      rec = col.write(rec, i);
+    }
+  });
+}
+
+void PLYWriterNode::append_to_file(const std::string& fname, const PointCollection& points, const std::vector<PLYColumn>& columns) {
+  std::string properties;
+  for (auto& col : columns) {
+    properties += std::string(col.type_name()) + " " + col.term->get_name() + "\n";
+  }
+  // start a new file if the path changed
+  if (!append_ofs.is_open() || fname != append_fname) {
+    if (append_ofs.is_open()) append_ofs.close();
+    append_ofs.open(fname, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!append_ofs.good()) {
+      throw(gfIOError("Could not open " + fname + " for writing"));
+    }
+    append_fname = fname;
+    append_properties = properties;
+    append_count = 0;
+    append_count_pos = write_ply_header(append_ofs, 0, columns, true);
+  } else if (properties != append_properties) {
+    throw(gfException("PLY attributes differ from the ones already written to " + fname));
+  }
+
+  write_ply_records(append_ofs, points, columns);
+  append_count += points.size();
+
+  // update the vertex count, so that the file is valid after every batch
+  auto end_pos = append_ofs.tellp();
+  append_ofs.seekp(append_count_pos);
+  append_ofs << std::left << std::setw(ply_count_width) << append_count;
+  append_ofs.seekp(end_pos);
+  append_ofs.flush();
+  if (!append_ofs.good()) {
+    throw(gfIOError("Failed writing " + fname));
+  }
+}
+
 void PLYWriterNode::process() {
-  auto geometries = input("geometries").get<PointCollection>();
+  auto& geometries = input("geometries").get<PointCollection>();
 
-  happly::PLYData plyOut;
+  auto fname = fs::path(manager.substitute_globals(filepath));
+  fs::create_directories(fname.parent_path());
 
-  plyOut.addElement("vertex", geometries.size());
   const size_t N = geometries.size();
+  std::vector<PLYColumn> columns;
+  for (auto& term : poly_input("attributes").sub_terminals()) {
+    if (term->size() != N) {
+      throw(gfException("PLY attribute " + term->get_name() + " has " + std::to_string(term->size()) + " values, expected " + std::to_string(N)));
+    }
+    columns.emplace_back(term);
+  }
+
+  if (append) {
+    append_to_file(fname.string(), geometries, columns);
+    return;
+  }
+
+  if (!write_ascii) {
+    std::ofstream ofs(fname, std::ios::out | std::ios::binary);
+    if (!ofs.good()) {
+      throw(gfIOError("Could not open " + fname.string() + " for writing"));
+    }
+    write_ply_header(ofs, N, columns);
+    write_ply_records(ofs, geometries, columns);
+    if (!ofs.good()) {
+      throw(gfIOError("Failed writing " + fname.string()));
+    }
+    return;
+  }
+
+  happly::PLYData plyOut;
+
+  plyOut.addElement("vertex", N);
   std::vector<float> xPos(N);
   std::vector<float> yPos(N);
   std::vector<float> zPos(N);
@@ -42,22 +281,525 @@ void PLYWriterNode::process() {
   plyOut.getElement("vertex").addProperty<float>("y", yPos);
   plyOut.getElement("vertex").addProperty<float>("z", zPos);
 
-  for (auto& term : poly_input("attributes").sub_terminals()) {
-      vec1f fvec;
-      for(size_t i=0; i<term->size(); ++i) {
-        fvec.push_back( term->get<float>(i) );
-      }
-      plyOut.getElement("vertex").addProperty(term->get_name(), fvec);
+  for (auto& col : columns) {
+    col.add_to(plyOut.getElement("vertex"), N);
   }
 
+  plyOut.write(fname.string(), happly::DataFormat::ASCII);
+
+}
+
+void PLYMeshWriterNode::process() {
+  auto& triangles = vector_input("triangles");
+  const bool multi = triangles.is_connected_type(typeid(MultiTriangleCollection));
+
   auto fname = fs::path(manager.substitute_globals(filepath));
   fs::create_directories(fname.parent_path());
 
-  if(write_ascii) 
-    plyOut.write(fname.string(), happly::DataFormat::ASCII);
-  else 
-    plyOut.write(fname.string(), happly::DataFormat::Binary);
+  // deduplicate the vertices and collect the 0-based vertex indices of all triangle corners
+  std::vector<arr3f> vertices;
+  std::vector<uint32_t> corners;
+  std::vector<int32_t> labels;
+  {
+    VertexIndex<arr3f> vertex_index;
+    auto add_triangles = [&](const TriangleCollection& tc) {
+      for (auto& triangle : tc) {
+        for (auto& vertex : triangle) {
+          auto [v_idx, did_insert] = vertex_index.insert(vertex, vertices.size());
+          if (did_insert) {
+            vertices.push_back(vertex);
+          }
+          corners.push_back(uint32_t(v_idx));
+        }
+      }
+    };
+    for (size_t j = 0; j < triangles.size(); ++j) {
+      if(!triangles.get_data_vec()[j].has_value()) continue;
+      if (multi) {
+        auto& mtcs = triangles.get<MultiTriangleCollection>(j);
+        for(size_t i=0; i<mtcs.tri_size(); i++) {
+          const auto& tc = mtcs.tri_at(i);
+          add_triangles(tc);
+          const auto& attr = mtcs.attr_at(i);
+          auto it = attr.find("labels");
+          for (size_t t = 0; t < tc.size(); ++t) {
+            labels.push_back(it == attr.end() ? 0 : std::get<int>(it->second[t]));
+          }
+        }
+      } else {
+        add_triangles(triangles.get<TriangleCollection>(j));
+      }
+    }
+  }
+  if (vertices.size() > std::numeric_limits<uint32_t>::max()) {
+    throw(gfException("Too many vertices for uint vertex indices in " + fname.string()));
+  }
+  if (!is_little_endian()) {
+    throw(gfIOError("binary PLY writing assumes a little endian system"));
+  }
+
+  // with the data offset applied the coordinates need double precision
+  const arr3d* offset = (no_offset || !manager.data_offset().has_value()) ? nullptr : &(*manager.data_offset());
+  const char* coord_type = offset ? "double" : "float";
+  const size_t n_faces = corners.size() / 3;
+
+  std::ofstream ofs(fname, std::ios::out | std::ios::binary);
+  if (!ofs.good()) {
+    throw(gfIOError("Could not open " + fname.string() + " for writing"));
+  }
+  ofs << "ply\n";
+  ofs << "format binary_little_endian 1.0\n";
+  ofs << "comment Created by Geoflow\n";
+  ofs << "element vertex " << vertices.size() << "\n";
+  ofs << "property " << coord_type << " x\n";
+  ofs << "property " << coord_type << " y\n";
+  ofs << "property " << coord_type << " z\n";
+  ofs << "element face " << n_faces << "\n";
+  ofs << "property list uchar uint vertex_indices\n";
+  if (multi) {
+    ofs << "property int label\n";
+  }
+  ofs << "end_header\n";
+
+  if (offset) {
+    write_ply_blocks(ofs, vertices.size(), 3 * sizeof(double), [&](char* dst, size_t i) {
+      double v[3] = {vertices[i][0] + (*offset)[0], vertices[i][1] + (*offset)[1], vertices[i][2] + (*offset)[2]};
+      std::memcpy(dst, v, sizeof(v));
+    });
+  } else {
+    write_ply_blocks(ofs, vertices.size(), 3 * sizeof(float), [&](char* dst, size_t i) {
+      std::memcpy(dst, vertices[i].data(), 3 * sizeof(float));
+    });
+  }
+
+  const size_t face_size = 1 + 3 * sizeof(uint32_t) + (multi ? sizeof(int32_t) : 0);
+  write_ply_blocks(ofs, n_faces, face_size, [&](char* dst, size_t i) {
+    *dst = 3;
+    std::memcpy(dst + 1, &corners[3 * i], 3 * sizeof(uint32_t));
+    if (multi) {
+      std::memcpy(dst + 1 + 3 * sizeof(uint32_t), &labels[i], sizeof(int32_t));
+    }
+  });
+
+  if (!ofs.good()) {
+    throw(gfIOError("Failed writing " + fname.string()));
+  }
+}
+
+// Read-only view of a whole file. The file is memory mapped where possible, on
+// Windows it is read into memory instead.
+class MappedFile {
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+#ifdef WIN32
+  std::vector<char> buf_;
+#endif
+
+  public:
+  MappedFile(const std::string& fname) {
+#ifdef WIN32
+    std::ifstream ifs(fname, std::ios::binary | std::ios::ate);
+    if (!ifs.good()) {
+      throw(gfIOError("Could not open " + fname));
+    }
+    buf_.resize(size_t(ifs.tellg()));
+    ifs.seekg(0);
+    ifs.read(buf_.data(), buf_.size());
+    data_ = buf_.data();
+    size_ = buf_.size();
+#else
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw(gfIOError("Could not open " + fname));
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      close(fd);
+      throw(gfIOError("Could not read " + fname));
+    }
+    size_ = size_t(st.st_size);
+    if (size_) {
+      void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        throw(gfIOError("Could not memory map " + fname));
+      }
+      data_ = (const char*) p;
+    }
+    close(fd);
+#endif
+  }
+  ~MappedFile() {
+#ifndef WIN32
+    if (data_) munmap((void*) data_, size_);
+#endif
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+};
+
+enum class PLYType { INT8, UINT8, INT16, UINT16, INT32, UINT32, FLOAT32, FLOAT64 };
+
+PLYType ply_type(const std::string& name) {
+  if (name == "char" || name == "int8") return PLYType::INT8;
+  if (name == "uchar" || name == "uint8") return PLYType::UINT8;
+  if (name == "short" || name == "int16") return PLYType::INT16;
+  if (name == "ushort" || name == "uint16") return PLYType::UINT16;
+  if (name == "int" || name == "int32") return PLYType::INT32;
+  if (name == "uint" || name == "uint32") return PLYType::UINT32;
+  if (name == "float" || name == "float32") return PLYType::FLOAT32;
+  if (name == "double" || name == "float64") return PLYType::FLOAT64;
+  throw(gfIOError("Unknown PLY property type " + name));
+}
+
+size_t ply_type_size(PLYType type) {
+  switch (type) {
+    case PLYType::INT8:
+    case PLYType::UINT8: return 1;
+    case PLYType::INT16:
+    case PLYType::UINT16: return 2;
+    case PLYType::INT32:
+    case PLYType::UINT32:
+    case PLYType::FLOAT32: return 4;
+    default: return 8;
+  }
+}
+
+template <typename T> T ply_load(const char* p, bool swap) {
+  T v;
+  if (swap) {
+    char b[sizeof(T)];
+    std::reverse_copy(p, p + sizeof(T), b);
+    std::memcpy(&v, b, sizeof(T));
+  } else {
+    std::memcpy(&v, p, sizeof(T));
+  }
+  return v;
+}
+
+// loads one binary value of the given PLY type and converts it to T
+template <typename T> T ply_load(const char* p, PLYType type, bool swap) {
+  switch (type) {
+    case PLYType::INT8: return T(ply_load<int8_t>(p, swap));
+    case PLYType::UINT8: return T(ply_load<uint8_t>(p, swap));
+    case PLYType::INT16: return T(ply_load<int16_t>(p, swap));
+    case PLYType::UINT16: return T(ply_load<uint16_t>(p, swap));
+    case PLYType::INT32: return T(ply_load<int32_t>(p, swap));
+    case PLYType::UINT32: return T(ply_load<uint32_t>(p, swap));
+    case PLYType::FLOAT32: return T(ply_load<float>(p, swap));
+    default: return T(ply_load<double>(p, swap));
+  }
+}
+
+struct PLYHeader {
+  enum Format { ASCII, BINARY_LE, BINARY_BE };
+  struct Property {
+    std::string name;
+    PLYType type;
+    bool is_list = false;
+    PLYType count_type;
+  };
+  struct Element {
+    std::string name;
+    size_t count = 0;
+    std::vector<Property> properties;
+  };
+  Format format;
+  std::vector<Element> elements;
+  // position of the first byte after the header
+  size_t body_offset;
+};
+
+PLYHeader read_ply_header(const MappedFile& file, const std::string& fname) {
+  std::string_view text(file.data(), file.size());
+  size_t end = text.find("end_header");
+  if (text.substr(0, 3) != "ply" || end == std::string_view::npos) {
+    throw(gfIOError(fname + " is not a PLY file"));
+  }
+  PLYHeader header;
+  header.body_offset = text.find('\n', end);
+  if (header.body_offset == std::string_view::npos) {
+    throw(gfIOError(fname + " has no PLY body"));
+  }
+  ++header.body_offset;
+
+  std::istringstream lines{std::string(text.substr(0, end))};
+  std::string line;
+  bool has_format = false;
+  while (std::getline(lines, line)) {
+    std::istringstream words(line);
+    std::string keyword;
+    words >> keyword;
+    if (keyword == "format") {
+      std::string format;
+      words >> format;
+      if (format == "ascii") header.format = PLYHeader::ASCII;
+      else if (format == "binary_little_endian") header.format = PLYHeader::BINARY_LE;
+      else if (format == "binary_big_endian") header.format = PLYHeader::BINARY_BE;
+      else throw(gfIOError("Unknown PLY format " + format + " in " + fname));
+      has_format = true;
+    } else if (keyword == "element") {
+      PLYHeader::Element element;
+      if (!(words >> element.name >> element.count)) {
+        throw(gfIOError("Invalid PLY element line \"" + line + "\" in " + fname));
+      }
+      header.elements.push_back(element);
+    } else if (keyword == "property") {
+      if (header.elements.empty()) {
+        throw(gfIOError("PLY property without element in " + fname));
+      }
+      PLYHeader::Property property;
+      std::string type;
+      words >> type;
+      if (type == "list") {
+        std::string count_type;
+        words >> count_type >> type;
+        property.is_list = true;
+        property.count_type = ply_type(count_type);
+      }
+      property.type = ply_type(type);
+      words >> property.name;
+      header.elements.back().properties.push_back(property);
+    }
+  }
+  if (!has_format) {
+    throw(gfIOError("PLY format missing in " + fname));
+  }
+  return header;
+}
+
+// Decoded values of a vertex property. Integer properties are output as int, except
+// uchar which is output as uint8_t, so that files from the PLYWriter round trip.
+struct PLYReadColumn {
+  std::string name;
+  PLYType type;
+  size_t offset;
+  std::vector<uint8_t> u8;
+  vec1i i32;
+  vec1f f32;
+  std::vector<double> f64;
+
+  PLYReadColumn(const std::string& name, PLYType type, size_t offset = 0)
+  : name(name), type(type), offset(offset) {}
+
+  void resize(size_t N) {
+    if (type == PLYType::UINT8) u8.resize(N);
+    else if (type == PLYType::FLOAT32) f32.resize(N);
+    else if (type == PLYType::FLOAT64) f64.resize(N);
+    else i32.resize(N);
+  }
+
+  void set(size_t i, const char* p, bool swap) {
+    if (type == PLYType::UINT8) u8[i] = ply_load<uint8_t>(p, swap);
+    else if (type == PLYType::FLOAT32) f32[i] = ply_load<float>(p, swap);
+    else if (type == PLYType::FLOAT64) f64[i] = ply_load<double>(p, swap);
+    else i32[i] = ply_load<int>(p, type, swap);
+  }
+
+  void set(size_t i, double v) {
+    if (type == PLYType::UINT8) u8[i] = uint8_t(v);
+    else if (type == PLYType::FLOAT32) f32[i] = float(v);
+    else if (type == PLYType::FLOAT64) f64[i] = v;
+    else i32[i] = int(v);
+  }
+
+  void push_to(gfMultiFeatureOutputTerminal& attributes) const {
+    if (type == PLYType::UINT8) {
+      auto& term = attributes.add_vector(name, typeid(uint8_t));
+      for (auto& v : u8) term.push_back(v);
+    } else if (type == PLYType::FLOAT32) {
+      auto& term = attributes.add_vector(name, typeid(float));
+      for (auto& v : f32) term.push_back(v);
+    } else if (type == PLYType::FLOAT64) {
+      auto& term = attributes.add_vector(name, typeid(double));
+      for (auto& v : f64) term.push_back(v);
+    } else {
+      auto& term = attributes.add_vector(name, typeid(int));
+      for (auto& v : i32) term.push_back(v);
+    }
+  }
+};
+
+// Sets the global data offset to the first point p of the file, unless it was set
+// already, and returns it
+arr3d ply_data_offset(NodeManager& manager, const arr3d& p) {
+  auto& data_offset = manager.data_offset();
+  if (!data_offset.has_value()) data_offset = p;
+  return *data_offset;
+}
+
+// Decodes the binary vertex records straight from the mapped file. The records are
+// split in chunks that are decoded on the thread pool. The coordinates are read as
+// double and narrowed to float after the data offset is subtracted.
+void read_ply_binary(const MappedFile& file, const PLYHeader& header, const std::string& fname, int n_threads, NodeManager& manager, PointCollection& points, std::vector<PLYReadColumn>& columns) {
+  const bool swap = (header.format == PLYHeader::BINARY_LE) != is_little_endian();
+  size_t offset = header.body_offset;
+  const PLYHeader::Element* vertex = nullptr;
+  for (auto& element : header.elements) {
+    size_t record_size = 0;
+    for (auto& property : element.properties) {
+      if (property.is_list) {
+        throw(gfIOError("Binary PLY elements with list properties before or in the vertex element are not supported, in " + fname));
+      }
+      record_size += ply_type_size(property.type);
+    }
+    if (element.name == "vertex") {
+      vertex = &element;
+      break;
+    }
+    if (record_size && element.count > (file.size() - offset) / record_size) {
+      throw(gfIOError("Unexpected end of PLY file " + fname));
+    }
+    offset += element.count * record_size;
+  }
+
+  size_t record_size = 0;
+  std::array<size_t, 3> xyz_offset;
+  std::array<PLYType, 3> xyz_type;
+  std::array<bool, 3> has_xyz = {false, false, false};
+  for (auto& property : vertex->properties) {
+    int c = property.name == "x" ? 0 : property.name == "y" ? 1 : property.name == "z" ? 2 : -1;
+    if (c >= 0) {
+      xyz_offset[c] = record_size;
+      xyz_type[c] = property.type;
+      has_xyz[c] = true;
+    } else {
+      columns.emplace_back(property.name, property.type, record_size);
+    }
+    record_size += ply_type_size(property.type);
+  }
+  if (!(has_xyz[0] && has_xyz[1] && has_xyz[2])) {
+    throw(gfIOError("PLY vertex element without x, y and z properties in " + fname));
+  }
+
+  const size_t N = vertex->count;
+  if (offset > file.size() || N > (file.size() - offset) / record_size) {
+    throw(gfIOError("Unexpected end of PLY file " + fname));
+  }
+  points.resize(N);
+  for (auto& col : columns) col.resize(N);
+
+  const char* body = file.data() + offset;
+  arr3d data_offset = {0, 0, 0};
+  if (N > 0) {
+    arr3d p;
+    for (size_t c = 0; c < 3; ++c) {
+      p[c] = ply_load<double>(body + xyz_offset[c], xyz_type[c], swap);
+    }
+    data_offset = ply_data_offset(manager, p);
+  }
+  const size_t chunk_size = 1 << 16;
+  ThreadPool pool(n_threads);
+  pool.parallel_for((N + chunk_size - 1) / chunk_size, [&](size_t chunk, size_t) {
+    size_t end = std::min(N, (chunk + 1) * chunk_size);
+    for (size_t i = chunk * chunk_size; i < end; ++i) {
+      const char* rec = body + i * record_size;
+      for (size_t c = 0; c < 3; ++c) {
+        points[i][c] = float(ply_load<double>(rec + xyz_offset[c], xyz_type[c], swap) - data_offset[c]);
+      }
+      for (auto& col : columns) {
+        col.set(i, rec + col.offset, swap);
+      }
+    }
+  });
+}
+
+// Parses the vertex element of an ASCII PLY file, one vertex per line. Like in
+// read_ply_binary() the data offset is subtracted from the coordinates.
+void read_ply_ascii(const MappedFile& file, const PLYHeader& header, const std::string& fname, NodeManager& manager, PointCollection& points, std::vector<PLYReadColumn>& columns) {
+  const char* p = file.data() + header.body_offset;
+  const char* end = file.data() + file.size();
+  auto skip_line = [&]() {
+    while (p < end && *p != '\n') ++p;
+    if (p < end) ++p;
+  };
+  auto next_value = [&]() {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+    double v;
+    auto result = std::from_chars(p, end, v);
+    if (result.ec != std::errc()) {
+      throw(gfIOError("Could not parse PLY value in " + fname));
+    }
+    p = result.ptr;
+    return v;
+  };
+
+  const PLYHeader::Element* vertex = nullptr;
+  for (auto& element : header.elements) {
+    if (element.name == "vertex") {
+      vertex = &element;
+      break;
+    }
+    for (size_t i = 0; i < element.count; ++i) skip_line();
+  }
+
+  // for every property the coordinate index, or -1 and its column
+  std::vector<int> coord;
+  std::vector<PLYReadColumn*> property_column;
+  for (auto& property : vertex->properties) {
+    int c = property.name == "x" ? 0 : property.name == "y" ? 1 : property.name == "z" ? 2 : -1;
+    coord.push_back(property.is_list ? -2 : c);
+    if (c == -1 && !property.is_list) {
+      columns.emplace_back(property.name, property.type);
+    }
+  }
+  if (std::count_if(coord.begin(), coord.end(), [](int c) { return c >= 0; }) != 3) {
+    throw(gfIOError("PLY vertex element without x, y and z properties in " + fname));
+  }
+  for (size_t j = 0, k = 0; j < coord.size(); ++j) {
+    property_column.push_back(coord[j] == -1 ? &columns[k++] : nullptr);
+  }
+
+  const size_t N = vertex->count;
+  points.resize(N);
+  for (auto& col : columns) col.resize(N);
+  arr3d data_offset;
+  for (size_t i = 0; i < N; ++i) {
+    arr3d p;
+    for (size_t j = 0; j < coord.size(); ++j) {
+      double v = next_value();
+      if (coord[j] >= 0) {
+        p[coord[j]] = v;
+      } else if (coord[j] == -1) {
+        property_column[j]->set(i, v);
+      } else {
+        // list properties are skipped
+        for (size_t n = size_t(v); n > 0; --n) next_value();
+      }
+    }
+    if (i == 0) data_offset = ply_data_offset(manager, p);
+    for (size_t c = 0; c < 3; ++c) {
+      points[i][c] = float(p[c] - data_offset[c]);
+    }
+    skip_line();
+  }
+}
 
+void PLYReaderNode::process() {
+  auto fname = manager.substitute_globals(filepath);
+  MappedFile file(fname);
+  auto header = read_ply_header(file, fname);
+
+  if (std::none_of(header.elements.begin(), header.elements.end(), [](auto& element) { return element.name == "vertex"; })) {
+    throw(gfIOError("No vertex element in PLY file " + fname));
+  }
+
+  PointCollection points;
+  std::vector<PLYReadColumn> columns;
+  if (header.format == PLYHeader::ASCII) {
+    read_ply_ascii(file, header, fname, manager, points, columns);
+  } else {
+    read_ply_binary(file, header, fname, n_threads, manager, points, columns);
+  }
+
+  auto& attributes = poly_output("attributes");
+  for (auto& col : columns) {
+    col.push_to(attributes);
+  }
+  output("points").set(points);
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,60 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+#include <array>
+#include <cstddef>
+
+namespace geoflow::nodes::basic3d
+{
+
+  // Jacobian of a coordinate transform f at a point p, estimated with forward
+  // differences from f(p) and f(step_point(k)), ie. p offset by a unit step along
+  // axis k. Used to reproject all normals of a feature with three extra transformed
+  // points, instead of transforming every point offset by its normal. The step
+  // points are floats like p and for large coordinates p + 1 is rounded, so the
+  // differences are divided by the step that was actually taken.
+  class NormalJacobian {
+    std::array<float,3> p_;
+    double J_[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+
+    public:
+    explicit NormalJacobian(const std::array<float,3>& p) : p_(p) {}
+
+    std::array<float,3> step_point(size_t k) const {
+      auto s = p_;
+      s[k] += 1;
+      return s;
+    }
+
+    // q is f(p), q_steps[k] is f(step_point(k))
+    template <typename P> void estimate(const P& q, const std::array<P,3>& q_steps) {
+      for (size_t k = 0; k < 3; ++k) {
+        double h = double(step_point(k)[k]) - double(p_[k]);
+        for (size_t r = 0; r < 3; ++r) J_[r][k] = (double(q_steps[k][r]) - double(q[r])) / h;
+      }
+    }
+
+    // J n, not normalised
+    std::array<float,3> apply(const std::array<float,3>& n) const {
+      std::array<float,3> m;
+      for (size_t r = 0; r < 3; ++r) {
+        m[r] = float(J_[r][0]*n[0] + J_[r][1]*n[1] + J_[r][2]*n[2]);
+      }
+      return m;
+    }
+  };
+
+} // namespace geoflow::nodes::basic3d
@@ -0,0 +1,78 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Checks that the rings of a CityJSON shell that collapse on the millimetre grid
+// are left out together with their semantic value, like CityJSONVertices and
+// mesh2jSolid do. The shell has a normal triangle, a triangle of 0.4 mm, a sliver
+// of 0.3 mm wide and a triangle with a repeated closing point.
+#include "../cityjson_rings.hpp"
+
+#include <array>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+using namespace geoflow::nodes::basic3d;
+
+typedef std::array<double,3> arr3d;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+  if (!ok) {
+    std::cout << "FAILED: " << what << "\n";
+    ++failures;
+  }
+}
+
+int main() {
+  const arr3d translate = {85000, 447000, 0};
+  const arr3d scale = {0.001, 0.001, 0.001};
+  const std::vector<std::vector<arr3d>> rings = {
+    {{85000.0, 447000.0, 1.0}, {85001.0, 447000.0, 1.0}, {85000.0, 447001.0, 1.0}},
+    {{85000.0001, 447000.0001, 1.0}, {85000.0004, 447000.0001, 1.0}, {85000.0001, 447000.0004, 1.0}},
+    {{85000.0, 447000.0, 1.0}, {85002.0, 447000.0003, 1.0}, {85002.0, 447000.0, 1.0}},
+    {{85000.0, 447000.0, 2.0}, {85001.0, 447000.0, 2.0}, {85000.0, 447001.0, 2.0}, {85000.0, 447000.0, 2.0}},
+  };
+  const std::vector<int> labels = {0, 1, 2, 3};
+
+  // one polygon per ring, without interior rings, empty if it is degenerate
+  std::vector<std::vector<std::vector<QuantizedVertex>>> shell;
+  for (auto& ring : rings) {
+    std::vector<QuantizedVertex> qring;
+    for (auto& p : ring) qring.push_back(quantize_cityjson_vertex(p, translate, scale));
+    auto& polygon = shell.emplace_back();
+    if (simplify_cityjson_ring(qring)) polygon.push_back(qring);
+  }
+  check(!shell[0].empty(), "a 1 m triangle is kept");
+  check(shell[1].empty(), "a 0.4 mm triangle is dropped");
+  check(shell[2].empty(), "a 2 m sliver that is 0.3 mm wide is dropped");
+  check(!shell[3].empty() && shell[3][0].size() == 3, "the closing point of a ring is dropped");
+
+  std::vector<QuantizedVertex> line = {{0, 0, 0}, {1, 0, 0}, {1, 0, 0}, {0, 0, 0}};
+  check(!simplify_cityjson_ring(line) && line.size() == 2, "a ring that collapses to a line is degenerate");
+
+  auto values = drop_degenerate_surfaces(shell, labels);
+  check(shell.size() == 2, "the degenerate surfaces are removed from the shell");
+  check(values == std::vector<int>({0, 3}), "the semantic values follow the surfaces that are left");
+  for (auto& polygon : shell) {
+    for (auto& ring : polygon) check(ring.size() >= 3, "every ring that is left has 3 vertices or more");
+  }
+
+  if (failures) return EXIT_FAILURE;
+  std::cout << "degenerate rings are dropped with their semantic values\n";
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Bounds the angular error of the GLTF normals that are reprojected with one
+// NormalJacobian per feature, against the exact derivative of the transform at
+// every point. The transform maps the process coordinates, ie. metres relative to
+// the data offset, to ECEF on a spherical earth, which bends the normals about as
+// much as a geographic to geocentric PROJ transform. The features are up to 60 m
+// across and lie within a 100 km area around the data offset. As in the node the
+// points are floats and f narrows its input to float, like the NodeManager.
+#include "../normal_jacobian.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace geoflow::nodes::basic3d;
+
+typedef std::array<float,3> arr3f;
+typedef std::array<double,3> arr3d;
+
+static const double pi = 3.14159265358979323846;
+static const double R = 6378137.0;
+static const double lat0 = 52.0 * pi / 180;
+static const double lon0 = 5.0 * pi / 180;
+
+static arr3d to_ecef(double x, double y, double z) {
+  double lat = lat0 + y / R;
+  double lon = lon0 + x / (R * std::cos(lat0));
+  double r = R + z;
+  return {r * std::cos(lat) * std::cos(lon), r * std::cos(lat) * std::sin(lon), r * std::sin(lat)};
+}
+
+static arr3d f(const arr3f& p) {
+  return to_ecef(p[0], p[1], p[2]);
+}
+
+// the direction of the derivative of to_ecef along n at p, by central differences
+static arr3d exact_direction(const arr3f& p, const arr3f& n) {
+  const double h = 1e-3;
+  auto a = to_ecef(p[0] + h * n[0], p[1] + h * n[1], p[2] + h * n[2]);
+  auto b = to_ecef(p[0] - h * n[0], p[1] - h * n[1], p[2] - h * n[2]);
+  return {a[0] - b[0], a[1] - b[1], a[2] - b[2]};
+}
+
+static double angle_degrees(const arr3d& a, const arr3f& b) {
+  double dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+  double la = std::sqrt(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+  double lb = std::sqrt(double(b[0]) * b[0] + double(b[1]) * b[1] + double(b[2]) * b[2]);
+  return std::acos(std::min(1.0, dot / (la * lb))) * 180 / pi;
+}
+
+int main() {
+  const double max_error_degrees = 0.01;
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<double> area(-50000, 50000), feature(-30, 30), height(0, 100), unit(-1, 1);
+
+  double max_error = 0;
+  for (size_t i = 0; i < 2000; ++i) {
+    double cx = area(rng), cy = area(rng);
+    std::vector<arr3f> points, normals;
+    for (size_t j = 0; j < 30; ++j) {
+      points.push_back({float(cx + feature(rng)), float(cy + feature(rng)), float(height(rng))});
+      arr3d n;
+      double l;
+      do {
+        n = {unit(rng), unit(rng), unit(rng)};
+        l = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+      } while (l < 0.1 || l > 1);
+      normals.push_back({float(n[0] / l), float(n[1] / l), float(n[2] / l)});
+    }
+
+    // like AttributeDataHelper::add_feature
+    NormalJacobian jacobian(points[0]);
+    jacobian.estimate(f(points[0]), {f(jacobian.step_point(0)), f(jacobian.step_point(1)), f(jacobian.step_point(2))});
+    for (size_t j = 0; j < points.size(); ++j) {
+      double error = angle_degrees(exact_direction(points[j], normals[j]), jacobian.apply(normals[j]));
+      max_error = std::max(max_error, error);
+    }
+  }
+
+  std::cout << "largest normal error " << max_error << " degrees, bound " << max_error_degrees << "\n";
+  return max_error <= max_error_degrees ? EXIT_SUCCESS : EXIT_FAILURE;
+}
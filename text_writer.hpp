@@ -0,0 +1,127 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <ostream>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace geoflow::nodes::basic3d
+{
+
+  // Buffered text output for the plain text writers. Numbers are formatted with
+  // std::to_chars into a reusable buffer that is written to the stream in large
+  // blocks. Floating point values are written in fixed notation with the given
+  // precision, ie. exactly like `os << std::fixed << std::setprecision(precision)`.
+  // Without a stream the text is collected in memory, eg. to format blocks of a
+  // file on multiple threads; see view() and clear().
+  class TextWriter {
+    std::ostream* os_;
+    std::vector<char> buf_;
+    size_t pos_ = 0;
+    int precision_;
+
+    // largest double in fixed notation is 309 digits plus sign and decimal point
+    static constexpr size_t max_fixed_chars = 312;
+
+    char* reserve(size_t n) {
+      if (pos_ + n > buf_.size()) {
+        if (os_) {
+          flush();
+          if (n > buf_.size()) buf_.resize(n);
+        } else {
+          buf_.resize(std::max(2 * buf_.size(), pos_ + n));
+        }
+      }
+      return buf_.data() + pos_;
+    }
+
+    public:
+    TextWriter(std::ostream& os, int precision = 6, size_t buffer_size = 1 << 20)
+    : os_(&os), buf_(buffer_size) {
+      set_precision(precision);
+    }
+    explicit TextWriter(int precision = 6, size_t initial_size = 1 << 12)
+    : os_(nullptr), buf_(initial_size) {
+      set_precision(precision);
+    }
+    ~TextWriter() { flush(); }
+
+    TextWriter(TextWriter&& other)
+    : os_(other.os_), buf_(std::move(other.buf_)), pos_(other.pos_), precision_(other.precision_) {
+      other.pos_ = 0;
+    }
+    TextWriter(const TextWriter&) = delete;
+    TextWriter& operator=(const TextWriter&) = delete;
+
+    // like iostreams a negative precision means the default of 6
+    void set_precision(int precision) { precision_ = precision < 0 ? 6 : precision; }
+
+    // writes the buffer to the stream, does nothing for an in-memory writer
+    void flush() {
+      if (os_ && pos_) os_->write(buf_.data(), pos_);
+      if (os_) pos_ = 0;
+    }
+
+    // text that is currently buffered
+    std::string_view view() const { return std::string_view(buf_.data(), pos_); }
+
+    // discards the buffered text, the memory is kept for reuse
+    void clear() { pos_ = 0; }
+
+    TextWriter& operator<<(char c) {
+      *reserve(1) = c;
+      ++pos_;
+      return *this;
+    }
+
+    TextWriter& operator<<(std::string_view s) {
+      // large blocks go straight to the stream
+      if (os_ && s.size() > buf_.size()) {
+        flush();
+        os_->write(s.data(), s.size());
+        return *this;
+      }
+      std::memcpy(reserve(s.size()), s.data(), s.size());
+      pos_ += s.size();
+      return *this;
+    }
+
+    TextWriter& operator<<(const char* s) { return *this << std::string_view(s); }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, char>::value && !std::is_same<T, bool>::value, TextWriter&>::type
+    operator<<(T v) {
+      char* p = reserve(24);
+      pos_ = std::to_chars(p, buf_.data() + buf_.size(), v).ptr - buf_.data();
+      return *this;
+    }
+
+    TextWriter& operator<<(double v) {
+      char* p = reserve(max_fixed_chars + precision_);
+      pos_ = std::to_chars(p, buf_.data() + buf_.size(), v, std::chars_format::fixed, precision_).ptr - buf_.data();
+      return *this;
+    }
+
+    // iostreams also print floats through double
+    TextWriter& operator<<(float v) { return *this << double(v); }
+  };
+
+} // namespace geoflow::nodes::basic3d
@@ -0,0 +1,121 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace geoflow::nodes::basic3d
+{
+
+  // Fixed size pool of worker threads for data parallel loops in the nodes.
+  // The thread that calls parallel_for() takes part in the work, so a pool of
+  // size 1 does not start any threads and runs everything inline.
+  class ThreadPool {
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_cv_, done_cv_;
+    std::function<void(size_t)> job_;
+    size_t generation_ = 0;
+    size_t active_ = 0;
+    bool stop_ = false;
+
+    void worker_loop(size_t thread_id) {
+      size_t seen = 0;
+      while (true) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+        if (stop_) return;
+        seen = generation_;
+        lock.unlock();
+        job_(thread_id);
+        lock.lock();
+        if (--active_ == 0) done_cv_.notify_one();
+      }
+    }
+
+    public:
+    // n_threads <= 0 means one thread per available core
+    explicit ThreadPool(int n_threads = 0) {
+      size_t n = n_threads > 0 ? size_t(n_threads) : std::max(1u, std::thread::hardware_concurrency());
+      for (size_t i = 1; i < n; ++i) {
+        workers_.emplace_back(&ThreadPool::worker_loop, this, i);
+      }
+    }
+
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      start_cv_.notify_all();
+      for (auto& w : workers_) w.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // number of threads, including the calling thread
+    size_t size() const { return workers_.size() + 1; }
+
+    // Calls f(i, thread_id) for every i in [0, n), with thread_id in [0, size()).
+    // Returns when all calls have finished. The first exception thrown by f is
+    // rethrown here, the remaining items are skipped in that case.
+    template <typename F> void parallel_for(size_t n, F&& f) {
+      if (n == 0) return;
+      if (workers_.empty() || n == 1) {
+        for (size_t i = 0; i < n; ++i) f(i, 0);
+        return;
+      }
+      std::atomic<size_t> next{0};
+      std::atomic<bool> failed{false};
+      std::exception_ptr error;
+      std::mutex error_mutex;
+      auto job = [&](size_t thread_id) {
+        size_t i;
+        while (!failed && (i = next++) < n) {
+          try {
+            f(i, thread_id);
+          } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!failed) error = std::current_exception();
+            failed = true;
+          }
+        }
+      };
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        job_ = job;
+        active_ = workers_.size();
+        ++generation_;
+      }
+      start_cv_.notify_all();
+      job(0);
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [&] { return active_ == 0; });
+        job_ = nullptr;
+      }
+      if (error) std::rethrow_exception(error);
+    }
+  };
+
+} // namespace geoflow::nodes::basic3d
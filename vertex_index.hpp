@@ -0,0 +1,136 @@
+// This file is part of gfp-basic3d
+// Copyright (C) 2018-2022 Ravi Peters
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace geoflow::nodes::basic3d
+{
+
+  // Open addressing hash table that maps a vertex to its index in the output
+  // vertex list. Keys are compared on their bit pattern and the index is stored
+  // inline with the key, so a lookup or insert is a single linear probe in one
+  // flat array. Works for any std::array<T,N> with a 4 or 8 byte arithmetic T.
+  template <typename Vertex> class VertexIndex {
+    typedef typename Vertex::value_type T;
+    static constexpr size_t N = std::tuple_size<Vertex>::value;
+    static_assert(std::is_arithmetic<T>::value && (sizeof(T) == 4 || sizeof(T) == 8), "unsupported vertex component type");
+    typedef typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type Bits;
+    typedef std::array<Bits, N> Key;
+
+    static constexpr size_t EMPTY = size_t(-1);
+    // a slot is only occupied if its generation matches the current one, which makes clear() O(1)
+    struct Slot {
+      Key key;
+      size_t index;
+      uint32_t gen = 0;
+    };
+
+    std::vector<Slot> slots_;
+    size_t mask_ = 0;
+    size_t size_ = 0;
+    uint32_t gen_ = 1;
+
+    static Key make_key(const Vertex& v) {
+      Key key;
+      for (size_t i = 0; i < N; ++i) {
+        // +0 turns -0.0 into 0.0 so that both map to the same vertex, like they did with std::set
+        T c = v[i] + T(0);
+        std::memcpy(&key[i], &c, sizeof(T));
+      }
+      return key;
+    }
+
+    static size_t hash(const Key& key) {
+      uint64_t h = 0x9E3779B97F4A7C15ull;
+      for (size_t i = 0; i < N; ++i) {
+        h ^= uint64_t(key[i]);
+        h *= 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 31;
+      }
+      return size_t(h);
+    }
+
+    void grow() {
+      std::vector<Slot> old;
+      old.swap(slots_);
+      size_t capacity = old.empty() ? 1024 : old.size() * 2;
+      slots_.resize(capacity);
+      mask_ = capacity - 1;
+      for (auto& slot : old) {
+        if (slot.gen == gen_) {
+          size_t i = hash(slot.key) & mask_;
+          while (slots_[i].gen == gen_) i = (i + 1) & mask_;
+          slots_[i] = slot;
+        }
+      }
+    }
+
+    public:
+    VertexIndex() = default;
+    explicit VertexIndex(size_t expected_size) { reserve(expected_size); }
+
+    // make room for n vertices without rehashing
+    void reserve(size_t n) {
+      while (slots_.size() * 7 < n * 10) grow();
+    }
+
+    size_t size() const { return size_; }
+
+    void clear() {
+      size_ = 0;
+      if (++gen_ == 0) {
+        for (auto& slot : slots_) slot.gen = 0;
+        gen_ = 1;
+      }
+    }
+
+    // Returns the index of vertex v. If v is not yet present it is assigned new_index.
+    // The second member of the returned pair is true in case v was inserted.
+    std::pair<size_t, bool> insert(const Vertex& v, size_t new_index) {
+      // keep the load factor below 0.7
+      if ((size_ + 1) * 10 > slots_.size() * 7) grow();
+      auto key = make_key(v);
+      size_t i = hash(key) & mask_;
+      while (slots_[i].gen == gen_) {
+        if (slots_[i].key == key) return {slots_[i].index, false};
+        i = (i + 1) & mask_;
+      }
+      slots_[i].key = key;
+      slots_[i].index = new_index;
+      slots_[i].gen = gen_;
+      ++size_;
+      return {new_index, true};
+    }
+
+    // Returns the index of vertex v, or size_t(-1) if it is not present
+    size_t find(const Vertex& v) const {
+      if (slots_.empty()) return EMPTY;
+      auto key = make_key(v);
+      size_t i = hash(key) & mask_;
+      while (slots_[i].gen == gen_) {
+        if (slots_[i].key == key) return slots_[i].index;
+        i = (i + 1) & mask_;
+      }
+      return EMPTY;
+    }
+  };
+
+} // namespace geoflow::nodes::basic3d